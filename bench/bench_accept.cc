@@ -0,0 +1,97 @@
+/*
+    连接建立速率压测：主线程accept后轮询转交（thread_pool::get_event_loop）与
+    SO_REUSEPORT分片accept两种模式的connections/sec对比。
+
+    服务器在fork出的子进程中运行，父进程起若干客户端线程，每个连接发送1字节、
+    收到回显后以RST关闭（避免TIME_WAIT耗尽本地端口）。
+*/
+#include"mrs.h"
+
+#include<chrono>
+#include<thread>
+#include<csignal>
+#include<sys/wait.h>
+#include<arpa/inet.h>
+
+static const int LOOP_THREADS = 3;
+static const int CLIENT_THREADS = 4;
+static const double DURATION = 3.0;
+
+class echo_connection : public tcp_connection{
+public:
+    using tcp_connection::tcp_connection;
+
+    int message(buffer* input) override{
+        input->send(this);
+        return 0;
+    }
+};
+
+static void run_server(int port, bool reuse_port){
+    set_log_enabled(false);
+    TCPserver<echo_connection> server(port, LOOP_THREADS);
+    server.set_reuse_port(reuse_port);
+    server.start();
+    server.run();
+}
+
+static bool one_connection(int port){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    //连接可能滞留在backlog中得不到accept，不能无限等待
+    timeval timeout{1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    bool ok = connect(fd, pointer_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+    char c = 'x';
+    ok = ok && write(fd, &c, 1) == 1 && ::read(fd, &c, 1) == 1;
+
+    linger l{1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+    close(fd);
+    return ok;
+}
+
+static double bench_mode(int port, bool reuse_port){
+    pid_t pid = fork();
+    if(pid == 0){
+        run_server(port, reuse_port);
+        _exit(0);
+    }
+    //等待服务器开始监听
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    std::atomic<long> connections{}, failures{};
+    std::vector<std::thread> clients;
+    auto start = std::chrono::steady_clock::now();
+    for(int i{}; i != CLIENT_THREADS; ++i)
+        clients.emplace_back([&]{
+            while(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < DURATION){
+                if(one_connection(port))
+                    ++connections;
+                else
+                    ++failures;
+            }
+        });
+    for(auto& t : clients)
+        t.join();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+
+    if(failures)
+        printf("  %ld connections timed out or failed\n", failures.load());
+    return connections / elapsed;
+}
+
+int main(){
+    double round_robin = bench_mode(17001, false);
+    printf("round-robin hand-off : %10.0f connections/s\n", round_robin);
+    double sharded = bench_mode(17002, true);
+    printf("SO_REUSEPORT sharded : %10.0f connections/s, x%.2f\n", sharded, sharded / round_robin);
+    return 0;
+}
@@ -0,0 +1,220 @@
+/*
+    buffer_pool开启前后的对比压测。
+
+    每种模式fork一个HTTP服务器进程，客户端在父进程中：
+    requests：在若干持久连接上逐个请求-响应往返，统计服务器进程中每个请求的
+              operator new次数，以及其中向堆申请buffer数据块的次数。
+    idle    ：建立IDLE_CONNECTIONS个连接，每个完成一次请求后保持空闲，统计服务器
+              进程的RSS和堆内存的增量。
+    服务器进程通过管道回报自己的计数。
+*/
+#include"mrs.h"
+
+#include<chrono>
+#include<thread>
+#include<malloc.h>
+#include<sys/wait.h>
+#include<arpa/inet.h>
+
+typedef std::chrono::steady_clock bench_clock;
+
+static const int LOOP_THREADS = 2;
+static const int CONNECTIONS = 16;
+static const int WARMUP_REQUESTS = 2000;
+static const int REQUESTS = 20000;
+static const int IDLE_CONNECTIONS = 10000;
+
+static const char HTTP_REQUEST[] = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+
+static std::atomic<long> allocations{};
+
+//统计全部的operator new调用
+void* operator new(size_t size){
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if(void* p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept{
+    free(p);
+}
+
+class hello_response : public http_response{
+public:
+    int request(http_request* /*a_http_request*/) override{
+        status = ok;
+        status_message = "OK";
+        content_type = "text/plain";
+        body.append_string("hello\n");
+        return 0;
+    }
+};
+
+struct server_sample{
+    long allocations;
+    long buffer_blocks;//buffer_pool向堆申请数据块的次数
+    long rss_kb;
+    long heap_kb;
+};
+
+static server_sample take_sample(){
+    server_sample sample{};
+    sample.allocations = allocations.load(std::memory_order_relaxed);
+    sample.buffer_blocks = buffer_pool::get_heap_allocations();
+    long pages{}, resident{};
+    if(FILE* f = fopen("/proc/self/statm", "r")){
+        if(fscanf(f, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    sample.rss_kb = resident * (sysconf(_SC_PAGESIZE) / 1024);
+    struct mallinfo2 info = mallinfo2();
+    sample.heap_kb = (info.uordblks + info.hblkhd) / 1024;
+    return sample;
+}
+
+static void serve(int port, bool pool_enabled, int command_fd, int reply_fd){
+    set_log_enabled(false);
+    buffer_pool::set_enabled(pool_enabled);
+    std::thread([port]{
+        auto server = new TCPserver<http_connection<hello_response>>(port, LOOP_THREADS);
+        server->start();
+        server->run();
+    }).detach();
+
+    //每收到一个字节回报一次计数，管道关闭时退出
+    char command;
+    while(read(command_fd, &command, 1) == 1){
+        server_sample sample = take_sample();
+        if(write(reply_fd, &sample, sizeof(sample)) != sizeof(sample))
+            break;
+    }
+    _exit(0);
+}
+
+static int connect_to(int port){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    timeval timeout{2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, pointer_cast<sockaddr*>(&addr), sizeof(addr))){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//发送一个请求并读到响应体的结尾，返回是否成功
+static bool round_trip(int fd){
+    if(write(fd, HTTP_REQUEST, sizeof(HTTP_REQUEST) - 1) != sizeof(HTTP_REQUEST) - 1)
+        return false;
+    char buf[1024];
+    size_t received{};
+    while(received < 6 || memcmp(buf + received - 6, "hello\n", 6)){
+        ssize_t n = ::read(fd, buf + received, sizeof(buf) - received);
+        if(n <= 0)
+            return false;
+        received += n;
+        if(received == sizeof(buf))
+            return false;
+    }
+    return true;
+}
+
+static void close_reset(int fd){
+    //以RST关闭，避免大量TIME_WAIT
+    linger l{1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+    close(fd);
+}
+
+static void bench_mode(const char* mode, int port, bool pool_enabled){
+    int command_pipe[2], reply_pipe[2];
+    if(pipe(command_pipe) || pipe(reply_pipe)){
+        perror("pipe");
+        return;
+    }
+    pid_t pid = fork();
+    if(pid == 0){
+        close(command_pipe[1]);
+        close(reply_pipe[0]);
+        serve(port, pool_enabled, command_pipe[0], reply_pipe[1]);
+    }
+    close(command_pipe[0]);
+    close(reply_pipe[1]);
+
+    auto sample = [&]{
+        server_sample s{};
+        if(write(command_pipe[1], "s", 1) != 1 || read(reply_pipe[0], &s, sizeof(s)) != sizeof(s))
+            fprintf(stderr, "server sample failed\n");
+        return s;
+    };
+    //等待服务器开始监听
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+    int fds[CONNECTIONS];
+    for(int& fd : fds)
+        fd = connect_to(port);
+    long failures{};
+    for(int i{}; i != WARMUP_REQUESTS; ++i)
+        failures += !round_trip(fds[i % CONNECTIONS]);
+
+    server_sample before = sample();
+    auto start = bench_clock::now();
+    for(int i{}; i != REQUESTS; ++i)
+        failures += !round_trip(fds[i % CONNECTIONS]);
+    double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+    server_sample after = sample();
+    for(int fd : fds)
+        close_reset(fd);
+
+    printf("%-8s requests : %8.0f req/s, %.2f allocations/req, %.3f buffer blocks/req",
+        mode, REQUESTS / elapsed, double(after.allocations - before.allocations) / REQUESTS,
+        double(after.buffer_blocks - before.buffer_blocks) / REQUESTS);
+    if(failures)
+        printf(", %ld failures", failures);
+    printf("\n");
+
+    //连接完成一次请求后保持空闲
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    before = sample();
+    std::vector<int> idle;
+    for(int i{}; i != IDLE_CONNECTIONS; ++i){
+        int fd = connect_to(port);
+        if(fd == -1 || !round_trip(fd)){
+            if(fd != -1)
+                close(fd);
+            break;
+        }
+        idle.push_back(fd);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    after = sample();
+
+    printf("%-8s idle     : %zu connections, RSS +%ld KB (%.1f KB/conn), heap +%ld KB (%.1f KB/conn)\n",
+        mode, idle.size(), after.rss_kb - before.rss_kb,
+        double(after.rss_kb - before.rss_kb) / std::max<size_t>(idle.size(), 1),
+        after.heap_kb - before.heap_kb,
+        double(after.heap_kb - before.heap_kb) / std::max<size_t>(idle.size(), 1));
+
+    for(int fd : idle)
+        close_reset(fd);
+    close(command_pipe[1]);
+    close(reply_pipe[0]);
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+}
+
+int main(){
+    bench_mode("disabled", 17301, false);
+    bench_mode("pooled", 17302, true);
+    return 0;
+}
@@ -0,0 +1,192 @@
+/*
+    channel查找/分发压测：对比旧的std::map<int, channel*>查表与现在的
+    fd平坦数组+epoll_event.data.ptr两种方式在1k、10k、100k个已注册fd下的events/sec。
+
+    lookup：合成事件序列，只测查找+回调，fd不需要真实存在。
+    epoll ：真实的eventfd注册到epoll中，每轮随机触发一批fd后调用dispatch。
+            受RLIMIT_NOFILE限制时fd数会被截断，并在输出中注明。
+*/
+#include"mrs.h"
+
+#include<chrono>
+#include<sys/eventfd.h>
+#include<sys/resource.h>
+
+static const int EVENTS_PER_ROUND = MAX_EVENTS;
+
+class bench_channel : public channel{
+public:
+    bench_channel(int a_fd) : channel(a_fd, EVENT_READ, nullptr) {}
+
+    int read() override{
+        uint64_t v;
+        if(::read(get_fd(), &v, sizeof(v)) == sizeof(v))
+            ++hits;
+        return 0;
+    }
+
+    static long hits;
+};
+
+long bench_channel::hits = 0;
+
+static unsigned next_random(unsigned& seed){
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start){
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+class counting_channel : public channel{
+public:
+    counting_channel(int a_fd) : channel(a_fd, EVENT_READ, nullptr), count{} {}
+
+    int read() override{
+        ++count;
+        return 0;
+    }
+
+    long count;
+};
+
+static void bench_lookup(int n){
+    const long total_events = 10000000;
+    std::vector<counting_channel*> channels;
+    std::map<int, channel*> old_map;
+    channel_map new_map;
+    for(int fd{}; fd != n; ++fd){
+        channels.push_back(new counting_channel(fd));
+        old_map[fd] = channels.back();
+        new_map.insert(fd, channels.back());
+    }
+
+    //预先生成事件序列，分别以fd和channel指针的形式保存
+    const int sequence_size = 1 << 16;
+    std::vector<epoll_event> by_fd(sequence_size), by_ptr(sequence_size);
+    unsigned seed = 1;
+    for(int i{}; i != sequence_size; ++i){
+        int fd = next_random(seed) % n;
+        by_fd[i].data.fd = fd;
+        by_ptr[i].data.ptr = channels[fd];
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for(long i{}; i != total_events; ++i){
+        int fd = by_fd[i & (sequence_size - 1)].data.fd;
+        if(!old_map.count(fd))
+            continue;
+        old_map[fd]->read();
+    }
+    double before = total_events / seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    for(long i{}; i != total_events; ++i){
+        channel* cc = static_cast<channel*>(by_ptr[i & (sequence_size - 1)].data.ptr);
+        new_map.activate(cc, EVENT_READ);
+    }
+    double after = total_events / seconds_since(start);
+
+    printf("lookup %7d fds: std::map %12.0f events/s, flat table %12.0f events/s, x%.2f\n",
+        n, before, after, after / before);
+
+    for(auto cc : channels)
+        delete cc;
+}
+
+static void bench_epoll(int n){
+    const int rounds = 10000;
+    std::vector<bench_channel*> channels;
+    std::map<int, channel*> old_map;
+
+    channel_map new_map;
+    //两边每轮取同样多的事件，关闭数组的自动增长
+    event_loop_options options;
+    options.max_events_limit = MAX_EVENTS;
+    epoll_dispatcher dispatcher(&new_map, options);
+    int old_efd = epoll_create1(0);
+
+    for(int i{}; i != n; ++i){
+        int fd = eventfd(0, EFD_NONBLOCK);
+        if(fd == -1){
+            n = i;
+            break;
+        }
+        bench_channel* cc = new bench_channel(fd);
+        channels.push_back(cc);
+
+        new_map.insert(fd, cc);
+        dispatcher.add(cc);
+
+        old_map[fd] = cc;
+        epoll_event event;
+        event.data.fd = fd;
+        event.events = EPOLLIN | EPOLLET;
+        epoll_ctl(old_efd, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    std::vector<int> fire(rounds * EVENTS_PER_ROUND);
+    unsigned seed = 7;
+    for(auto& i : fire)
+        i = next_random(seed) % n;
+
+    uint64_t one = 1;
+    epoll_event events[MAX_EVENTS];
+
+    //旧实现：data.fd + 两次std::map查找
+    bench_channel::hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(int r{}; r != rounds; ++r){
+        for(int k{}; k != EVENTS_PER_ROUND; ++k)
+            write(channels[fire[r * EVENTS_PER_ROUND + k]]->get_fd(), &one, sizeof(one));
+        int m = epoll_wait(old_efd, events, MAX_EVENTS, -1);
+        for(int i{}; i < m; ++i){
+            int fd = events[i].data.fd;
+            if(!old_map.count(fd))
+                continue;
+            old_map[fd]->read();
+        }
+    }
+    double before = bench_channel::hits / seconds_since(start);
+
+    //新实现：event_dispatcher::dispatch直接取data.ptr
+    bench_channel::hits = 0;
+    start = std::chrono::steady_clock::now();
+    for(int r{}; r != rounds; ++r){
+        for(int k{}; k != EVENTS_PER_ROUND; ++k)
+            write(channels[fire[r * EVENTS_PER_ROUND + k]]->get_fd(), &one, sizeof(one));
+        dispatcher.dispatch();
+    }
+    double after = bench_channel::hits / seconds_since(start);
+
+    printf("epoll  %7d fds: std::map %12.0f events/s, flat table %12.0f events/s, x%.2f\n",
+        n, before, after, after / before);
+
+    close(old_efd);
+    for(auto cc : channels){
+        close(cc->get_fd());
+        delete cc;
+    }
+}
+
+int main(){
+    set_log_enabled(false);
+
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    int max_fds = static_cast<int>(limit.rlim_cur) - 64;
+
+    const int sizes[] = {1000, 10000, 100000};
+    for(int n : sizes)
+        bench_lookup(n);
+
+    for(int n : sizes){
+        if(n > max_fds)
+            printf("epoll  %7d fds: RLIMIT_NOFILE = %d, truncated\n", n, max_fds + 64);
+        bench_epoll(n < max_fds ? n : max_fds);
+    }
+    return 0;
+}
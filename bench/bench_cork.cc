@@ -0,0 +1,150 @@
+/*
+    corked_writes开启前后的对比压测。
+
+    服务器对每个请求分两次send_data发送响应头和响应体，客户端在每个连接上一次写入
+    PIPELINE个流水线请求，再读完全部响应。统计每个响应的发送系统调用数（event_loop
+    的socket_writes），以及客户端套接字收到的数据报文数（TCP_INFO的tcpi_data_segs_in）。
+    每种模式在同一进程内各起一个服务器。
+    连接上没有设置TCP_NODELAY，direct模式中后一次send_data会被Nagle算法扣住，等待
+    客户端延迟发出的ACK，吞吐量的差距主要来自这里。
+*/
+#include"mrs.h"
+
+#include<chrono>
+#include<thread>
+#include<arpa/inet.h>
+#include<linux/tcp.h>//tcp_info
+
+typedef std::chrono::steady_clock bench_clock;
+
+static const int CONNECTIONS = 8;
+static const int PIPELINE = 16;
+static const int ROUNDS = 200;
+static const int BODY_SIZE = 32;
+
+static const char REQUEST[] = "GET\n";
+static const int REQUEST_SIZE = sizeof(REQUEST) - 1;
+static const char HEADER[] = "HDR 32\n";
+static const int RESPONSE_SIZE = sizeof(HEADER) - 1 + BODY_SIZE;
+
+class split_connection : public tcp_connection{
+public:
+    using tcp_connection::tcp_connection;
+
+    int message(buffer* input) override{
+        static const char body[BODY_SIZE] = {};
+        int requests = input->get_readable_size() / REQUEST_SIZE;
+        input->consume(requests * REQUEST_SIZE);
+        for(int i{}; i != requests; ++i){
+            send_data(HEADER, sizeof(HEADER) - 1);
+            send_data(body, BODY_SIZE);
+        }
+        return 0;
+    }
+};
+
+static TCPserver<split_connection>* start_server(int port, bool corked){
+    std::atomic<TCPserver<split_connection>*> server{};
+    std::thread([&server, port, corked]{
+        event_loop_options options;
+        options.corked_writes = corked;
+        auto s = new TCPserver<split_connection>(port, 1, options);
+        s->start();
+        server = s;
+        s->run();
+    }).detach();
+    while(!server)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    //等待从reactor线程开始运行
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    return server;
+}
+
+static int connect_to(int port){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    timeval timeout{2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, pointer_cast<sockaddr*>(&addr), sizeof(addr))){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static long data_segments_in(int fd){
+    tcp_info info{};
+    socklen_t length = sizeof(info);
+    if(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length))
+        return 0;
+    return info.tcpi_data_segs_in;
+}
+
+//所有连接各发送一批流水线请求，再依次读完响应，返回失败的连接数
+static long run_round(int* fds){
+    char requests[PIPELINE * REQUEST_SIZE];
+    for(int i{}; i != PIPELINE; ++i)
+        memcpy(requests + i * REQUEST_SIZE, REQUEST, REQUEST_SIZE);
+    static char sink[PIPELINE * RESPONSE_SIZE];
+
+    long failures{};
+    for(int c{}; c != CONNECTIONS; ++c)
+        if(write(fds[c], requests, sizeof(requests)) != sizeof(requests))
+            ++failures;
+    for(int c{}; c != CONNECTIONS; ++c){
+        size_t received{};
+        while(received < sizeof(sink)){
+            ssize_t n = ::read(fds[c], sink + received, sizeof(sink) - received);
+            if(n <= 0){
+                ++failures;
+                break;
+            }
+            received += n;
+        }
+    }
+    return failures;
+}
+
+static void bench_mode(const char* mode, int port, bool corked){
+    auto server = start_server(port, corked);
+    event_loop* loop = server->get_thread_pool()->get_event_loop(0);
+
+    int fds[CONNECTIONS];
+    for(int& fd : fds)
+        fd = connect_to(port);
+    long failures = run_round(fds);
+
+    long segments_before{};
+    for(int fd : fds)
+        segments_before += data_segments_in(fd);
+    event_loop_stats before = loop->get_stats();
+    auto start = bench_clock::now();
+    for(int i{}; i != ROUNDS; ++i)
+        failures += run_round(fds);
+    double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+    event_loop_stats after = loop->get_stats();
+    long segments_after{};
+    for(int fd : fds)
+        segments_after += data_segments_in(fd);
+
+    double responses = double(ROUNDS) * CONNECTIONS * PIPELINE;
+    printf("%-8s : %9.0f responses/s, %.3f write syscalls/response, %.3f data segments/response, %ld deferred flushes",
+        mode, responses / elapsed, (after.socket_writes - before.socket_writes) / responses,
+        (segments_after - segments_before) / responses, after.deferred_flushes - before.deferred_flushes);
+    if(failures)
+        printf(", %ld failures", failures);
+    printf("\n");
+
+    for(int fd : fds)
+        close(fd);
+}
+
+int main(){
+    set_log_enabled(false);
+    bench_mode("direct", 17501, false);
+    bench_mode("corked", 17502, true);
+    return 0;
+}
@@ -0,0 +1,192 @@
+/*
+    epoll与io_uring两种event_dispatcher的对比压测。
+
+    同一进程内为每种后端各起一个echo服务器和一个HTTP服务器，客户端线程在若干
+    持久连接上逐个请求-响应往返，统计req/s、每个请求的系统调用次数以及往返延迟
+    的p50/p99。系统调用包括dispatcher的（event_dispatcher::get_syscalls的差值）
+    和服务器各event_loop上连接的读、写与accept（event_loop_stats的差值）。
+*/
+#include"mrs.h"
+
+#include<chrono>
+#include<future>
+#include<thread>
+#include<arpa/inet.h>
+
+typedef std::chrono::steady_clock bench_clock;
+
+static const int LOOP_THREADS = 1;
+static const int CLIENT_THREADS = 2;
+static const int CONNECTIONS_PER_CLIENT = 16;
+static const double DURATION = 2.0;
+
+static const char HTTP_REQUEST[] = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+
+class echo_connection : public tcp_connection{
+public:
+    using tcp_connection::tcp_connection;
+
+    int message(buffer* input) override{
+        input->send(this);
+        return 0;
+    }
+};
+
+class hello_response : public http_response{
+public:
+    int request(http_request* /*a_http_request*/) override{
+        status = ok;
+        status_message = "OK";
+        content_type = "text/plain";
+        body.append_string("hello\n");
+        return 0;
+    }
+};
+
+//服务器各event_loop上连接读、写和accept的系统调用次数之和
+typedef std::function<long()> io_counter;
+
+template<typename Connection_Type>
+static io_counter start_server(int port, dispatcher_backend backend){
+    std::promise<TCPserver<Connection_Type>*> started;
+    auto result = started.get_future();
+    //TCPserver::run不会返回，服务器线程随进程一起结束
+    std::thread([port, backend, &started]{
+        event_loop_options options;
+        options.backend = backend;
+        auto server = new TCPserver<Connection_Type>(port, LOOP_THREADS, options);
+        server->start();
+        started.set_value(server);
+        server->run();
+    }).detach();
+
+    auto server = result.get();
+    return [server]{
+        std::vector<event_loop*> loops{server->get_main_loop()};
+        for(int i{}; i != LOOP_THREADS; ++i)
+            loops.push_back(server->get_thread_pool()->get_event_loop(i));
+        long n{};
+        for(auto loop : loops){
+            event_loop_stats stats = loop->get_stats();
+            n += stats.socket_reads + stats.socket_writes + stats.socket_accepts;
+        }
+        return n;
+    };
+}
+
+static int connect_to(int port){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    timeval timeout{2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, pointer_cast<sockaddr*>(&addr), sizeof(addr))){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//发送一个请求并读满response_size字节，返回是否成功
+static bool round_trip(int fd, const char* request, size_t request_size, size_t response_size){
+    if(write(fd, request, request_size) != ssize_t(request_size))
+        return false;
+    char buf[1024];
+    size_t received{};
+    while(received < response_size){
+        ssize_t n = ::read(fd, buf, sizeof(buf));
+        if(n <= 0)
+            return false;
+        received += n;
+    }
+    return true;
+}
+
+static size_t probe_response_size(int port, const char* request, size_t request_size){
+    //响应长度固定，先取一次作为之后每次读满的长度
+    int fd = connect_to(port);
+    if(fd == -1 || write(fd, request, request_size) != ssize_t(request_size))
+        return 0;
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    char buf[1024];
+    ssize_t n = ::read(fd, buf, sizeof(buf));
+    close(fd);
+    return n > 0 ? n : 0;
+}
+
+static void bench_workload(const char* workload, const char* backend, int port, const io_counter& io_syscalls,
+                            const char* request, size_t request_size){
+    size_t response_size = probe_response_size(port, request, request_size);
+    if(!response_size){
+        printf("%-4s %-13s : server not responding\n", workload, backend);
+        return;
+    }
+
+    std::vector<std::vector<double>> latency(CLIENT_THREADS);
+    std::atomic<long> failures{};
+    std::vector<std::thread> clients;
+
+    long syscalls_before = event_dispatcher::get_syscalls();
+    long io_before = io_syscalls();
+    auto start = bench_clock::now();
+    for(int i{}; i != CLIENT_THREADS; ++i)
+        clients.emplace_back([&, i]{
+            std::vector<int> fds;
+            for(int j{}; j != CONNECTIONS_PER_CLIENT; ++j)
+                fds.push_back(connect_to(port));
+            //连接轮流发请求，让服务器上同时有多个连接活跃
+            for(size_t k{}; std::chrono::duration<double>(bench_clock::now() - start).count() < DURATION; ++k){
+                int fd = fds[k % fds.size()];
+                auto begin = bench_clock::now();
+                if(fd == -1 || !round_trip(fd, request, request_size, response_size)){
+                    ++failures;
+                    continue;
+                }
+                latency[i].push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - begin).count());
+            }
+            for(int fd : fds)
+                if(fd != -1)
+                    close(fd);
+        });
+    for(auto& t : clients)
+        t.join();
+    double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+    long syscalls = event_dispatcher::get_syscalls() - syscalls_before;
+    long io = io_syscalls() - io_before;
+
+    std::vector<double> all;
+    for(auto& l : latency)
+        all.insert(all.end(), l.begin(), l.end());
+    if(all.empty()){
+        printf("%-4s %-13s : no request completed\n", workload, backend);
+        return;
+    }
+    std::sort(all.begin(), all.end());
+    double requests = all.size();
+    printf("%-4s %-13s : %9.0f req/s, %.2f syscalls/req (dispatcher %.2f, socket I/O %.2f), p50 %.1f us, p99 %.1f us",
+        workload, backend, requests / elapsed, (syscalls + io) / requests, syscalls / requests, io / requests,
+        all[all.size() / 2], all[all.size() * 99 / 100]);
+    if(failures)
+        printf(", %ld failures", failures.load());
+    printf("\n");
+}
+
+int main(){
+    set_log_enabled(false);
+
+    auto echo_epoll = start_server<echo_connection>(17101, backend_epoll);
+    auto echo_uring = start_server<echo_connection>(17102, backend_uring_poll);
+    auto http_epoll = start_server<http_connection<hello_response>>(17103, backend_epoll);
+    auto http_uring = start_server<http_connection<hello_response>>(17104, backend_uring_poll);
+
+    const char echo_request[] = "0123456789abcdef0123456789abcdef";
+    bench_workload("echo", "epoll", 17101, echo_epoll, echo_request, sizeof(echo_request) - 1);
+    bench_workload("echo", "io_uring poll", 17102, echo_uring, echo_request, sizeof(echo_request) - 1);
+    bench_workload("http", "epoll", 17103, http_epoll, HTTP_REQUEST, sizeof(HTTP_REQUEST) - 1);
+    bench_workload("http", "io_uring poll", 17104, http_uring, HTTP_REQUEST, sizeof(HTTP_REQUEST) - 1);
+
+    fflush(stdout);
+    _exit(0);
+}
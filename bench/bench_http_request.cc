@@ -0,0 +1,163 @@
+/*
+    HTTP请求解析到生成响应这一段的内存分配压测。
+
+    在单线程中反复把一个典型浏览器请求写入buffer，解析后交给http_response子类处理，
+    读取路径和几个请求头，编码响应后丢弃。统计每个请求的operator new次数和耗时，
+    预热之后buffer和chain_buffer的数据块都来自buffer_pool。
+    另外比较解析好的请求上get_header的几种查找方式，与逐个比较名称的线性查找对照。
+*/
+#include"mrs.h"
+
+#include<chrono>
+#include<strings.h>//strncasecmp()
+
+typedef std::chrono::steady_clock bench_clock;
+
+static const int WARMUP_REQUESTS = 1000;
+static const int REQUESTS = 200000;
+static const int LOOKUPS = 2000000;
+
+static const char BROWSER_REQUEST[] =
+    "GET /static/css/main.css?v=20231018 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: style\r\n"
+    "Referer: https://www.example.com/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=0123456789abcdef; theme=dark\r\n"
+    "\r\n";
+
+static std::atomic<long> allocations{};
+
+//统计全部的operator new调用
+void* operator new(size_t size){
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if(void* p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept{
+    free(p);
+}
+
+class path_response : public http_response{
+public:
+    int request(http_request* a_http_request) override{
+        status = ok;
+        status_message = "OK";
+        content_type = "text/css";
+        std::string_view path = a_http_request->get_path();
+        std::string_view agent = a_http_request->get_header("User-Agent");
+        std::string_view accept = a_http_request->get_header("Accept");
+        body.append(path.data(), path.size());
+        body.append_char(agent.empty() || accept.empty() ? '?' : '\n');
+        return 0;
+    }
+};
+
+//与http_connection相同的顺序：解析、生成响应、编码，最后consume请求头
+static long handle_requests(buffer* input, http_request* request, int n){
+    long failures{};
+    for(int i{}; i != n; ++i){
+        input->append(BROWSER_REQUEST, sizeof(BROWSER_REQUEST) - 1);
+        if(request->parse_http_request(input) != 1){
+            ++failures;
+            input->consume(input->get_readable_size());
+            continue;
+        }
+        path_response response;
+        response.request(request);
+        chain_buffer output;
+        response.encode_buffer(&output);
+        failures += request->close_connection();
+        input->consume(request->get_length());
+        request->reset();
+    }
+    return failures;
+}
+
+//原来的查找方式：逐个比较全部请求头的名称
+static std::string_view linear_lookup(const std::vector<std::pair<std::string_view, std::string_view>>& headers,
+    std::string_view key){
+    for(auto& header : headers)
+        if(header.first.size() == key.size() && strncasecmp(header.first.data(), key.data(), key.size()) == 0)
+            return header.second;
+    return std::string_view();
+}
+
+template<typename LOOKUP>
+static void bench_lookup(const char* name, LOOKUP lookup){
+    size_t found{};
+    auto start = bench_clock::now();
+    for(int i{}; i != LOOKUPS; ++i)
+        found += lookup().size();
+    double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+    printf("%-28s : %6.1f ns/lookup%s\n", name, elapsed * 1e9 / LOOKUPS, found ? "" : " (not found)");
+}
+
+static void bench_lookups(){
+    buffer input;
+    http_request request;
+    input.append(BROWSER_REQUEST, sizeof(BROWSER_REQUEST) - 1);
+    if(request.parse_http_request(&input) != 1)
+        return;
+
+    //从原始请求中取出请求头，供线性查找使用
+    std::vector<std::pair<std::string_view, std::string_view>> headers;
+    std::string_view text(BROWSER_REQUEST);
+    for(size_t line = text.find("\r\n") + 2; text.compare(line, 2, "\r\n") != 0;){
+        size_t end = text.find("\r\n", line);
+        size_t colon = text.find(':', line);
+        headers.emplace_back(text.substr(line, colon - line), text.substr(colon + 2, end - colon - 2));
+        line = end + 2;
+    }
+
+    //volatile避免查找被提到循环之外
+    static const char* volatile connection = "connection";
+    static const char* volatile platform = "sec-ch-ua-platform";
+    static const char* volatile missing = "X-Request-Id";
+    bench_lookup("linear Connection", [&]{ return linear_lookup(headers, connection); });
+    bench_lookup("linear sec-ch-ua-platform", [&]{ return linear_lookup(headers, platform); });
+    bench_lookup("linear X-Request-Id", [&]{ return linear_lookup(headers, missing); });
+    bench_lookup("id header_connection", [&]{ return request.get_header(header_connection); });
+    bench_lookup("id header_range", [&]{ return request.get_header(header_range); });
+    bench_lookup("name Connection", [&]{ return request.get_header(connection); });
+    bench_lookup("name sec-ch-ua-platform", [&]{ return request.get_header(platform); });
+    bench_lookup("name X-Request-Id", [&]{ return request.get_header(missing); });
+}
+
+int main(){
+    set_log_enabled(false);
+    buffer input;
+    http_request request;
+
+    long failures = handle_requests(&input, &request, WARMUP_REQUESTS);
+
+    long before = allocations.load(std::memory_order_relaxed);
+    auto start = bench_clock::now();
+    failures += handle_requests(&input, &request, REQUESTS);
+    double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+    long after = allocations.load(std::memory_order_relaxed);
+
+    printf("parse+handle : %.1f ns/request, %.2f allocations/request",
+        elapsed * 1e9 / REQUESTS, double(after - before) / REQUESTS);
+    if(failures)
+        printf(", %ld failures", failures);
+    printf("\n");
+
+    bench_lookups();
+    return 0;
+}
@@ -0,0 +1,127 @@
+/*
+    跨线程注册channel的竞争压测：N个生产者线程对应一个消费者（模拟event_loop）。
+    旧实现为pthread_mutex加每次new一个channel_element的链表，消费者持锁遍历；
+    新实现为pending_channel_queue。
+*/
+#include"mrs.h"
+
+#include<chrono>
+#include<thread>
+
+static const int CHANNELS_PER_PRODUCER = 64;
+
+static double seconds_since(std::chrono::steady_clock::time_point start){
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+class locked_pending_list{
+/*
+    改造前event_loop中的实现。
+*/
+public:
+    locked_pending_list() : front(nullptr), back(nullptr) {
+        pthread_mutex_init(&mutex, nullptr);
+    }
+
+    void push(channel* cc, int type){
+        pthread_mutex_lock(&mutex);
+        element* e = new element{cc, type, nullptr};
+        if(!front)
+            front = back = e;
+        else{
+            back->next = e;
+            back = e;
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    long drain(){
+        long n{};
+        pthread_mutex_lock(&mutex);
+        while(front){
+            element* e = front;
+            front = front->next;
+            ++n;
+            delete e;
+        }
+        back = nullptr;
+        pthread_mutex_unlock(&mutex);
+        return n;
+    }
+
+private:
+    struct element{
+        channel* cc;
+        int type;
+        element* next;
+    };
+    element* front;
+    element* back;
+    pthread_mutex_t mutex;
+};
+
+template<typename PUSH, typename DRAIN>
+static double run_queue(int producers, long ops_per_producer, PUSH push, DRAIN drain){
+    std::atomic<int> done{};
+    std::vector<std::thread> threads;
+
+    auto start = std::chrono::steady_clock::now();
+    for(int t{}; t != producers; ++t)
+        threads.emplace_back([&, t]{
+            for(long i{}; i != ops_per_producer; ++i)
+                push(t * CHANNELS_PER_PRODUCER + i % CHANNELS_PER_PRODUCER);
+            ++done;
+        });
+
+    //消费者，模拟event_loop每轮处理一次
+    while(done.load() != producers){
+        drain();
+        std::this_thread::yield();
+    }
+    drain();
+    double elapsed = seconds_since(start);
+
+    for(auto& t : threads)
+        t.join();
+    return producers * ops_per_producer / elapsed;
+}
+
+static void bench_queue(int producers){
+    const long ops = 2000000 / producers;
+    std::vector<channel*> channels;
+    for(int i{}; i != producers * CHANNELS_PER_PRODUCER; ++i)
+        channels.push_back(new channel(-1, EVENT_READ, nullptr));
+
+    locked_pending_list locked;
+    double before = run_queue(producers, ops,
+        [&](int i){ locked.push(channels[i], PENDING_UPDATE); },
+        [&]{ locked.drain(); });
+
+    pending_channel_queue lock_free;
+    double after = run_queue(producers, ops,
+        [&](int i){ lock_free.push(channels[i], PENDING_UPDATE); },
+        [&]{
+            channel* p = lock_free.pop_all();
+            while(p){
+                channel* next;
+                pending_channel_queue::take(p, next);
+                p = next;
+            }
+        });
+
+    printf("queue %d producers: mutex list %11.0f ops/s, lock-free %11.0f ops/s, x%.2f\n",
+        producers, before, after, after / before);
+
+    for(auto cc : channels)
+        delete cc;
+}
+
+int main(){
+    set_log_enabled(false);
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+
+    const int producers[] = {1, 2, 4, 8};
+    for(int n : producers)
+        bench_queue(n);
+    return 0;
+}
@@ -0,0 +1,124 @@
+/*
+    HTTP/1.1流水线压测。
+
+    客户端在每个连接上一次写入depth个请求，再读完全部响应，比较不同深度下的
+    请求速率，以及每个响应的发送系统调用数（event_loop的socket_writes）。
+    同一轮中解析出的请求，响应合成一次聚集写发出。
+*/
+#include"mrs.h"
+
+#include<chrono>
+#include<thread>
+#include<arpa/inet.h>
+
+typedef std::chrono::steady_clock bench_clock;
+
+static const int PORT = 17601;
+static const int CONNECTIONS = 8;
+static const int REQUESTS_PER_CONNECTION = 16384;
+
+static const char HTTP_REQUEST[] = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+static const char RESPONSE_BODY[] = "hello\n";
+
+class hello_response : public http_response{
+public:
+    int request(http_request* /*a_http_request*/) override{
+        status = ok;
+        status_message = "OK";
+        content_type = "text/plain";
+        body.append_string(RESPONSE_BODY);
+        return 0;
+    }
+};
+
+static int connect_to(int port){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    timeval timeout{2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, pointer_cast<sockaddr*>(&addr), sizeof(addr))){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//读到第count个响应体的结尾为止
+static bool read_responses(int fd, int count){
+    static char buf[1 << 16];
+    size_t body_size = sizeof(RESPONSE_BODY) - 1;
+    int seen{};
+    size_t kept{};
+    while(seen < count){
+        ssize_t n = ::read(fd, buf + kept, sizeof(buf) - kept);
+        if(n <= 0)
+            return false;
+        size_t size = kept + n;
+        //响应体在每个响应的末尾，按它计数
+        size_t i{};
+        for(; i + body_size <= size; ++i)
+            if(memcmp(buf + i, RESPONSE_BODY, body_size) == 0){
+                ++seen;
+                i += body_size - 1;
+            }
+        //末尾可能是被截断的响应体
+        kept = std::min(size, body_size - 1);
+        memmove(buf, buf + size - kept, kept);
+    }
+    return true;
+}
+
+static void bench_depth(TCPserver<http_connection<hello_response>>* server, int depth){
+    event_loop* loop = server->get_thread_pool()->get_event_loop(0);
+    std::string batch;
+    for(int i{}; i != depth; ++i)
+        batch += HTTP_REQUEST;
+
+    int fds[CONNECTIONS];
+    for(int& fd : fds)
+        fd = connect_to(PORT);
+
+    long failures{};
+    event_loop_stats before = loop->get_stats();
+    auto start = bench_clock::now();
+    for(int sent{}; sent < REQUESTS_PER_CONNECTION; sent += depth){
+        for(int fd : fds)
+            if(write(fd, batch.data(), batch.size()) != ssize_t(batch.size()))
+                ++failures;
+        for(int fd : fds)
+            failures += !read_responses(fd, depth);
+    }
+    double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+    event_loop_stats after = loop->get_stats();
+
+    double requests = double(REQUESTS_PER_CONNECTION) * CONNECTIONS;
+    printf("depth %2d : %9.0f req/s, %.3f write syscalls/response",
+        depth, requests / elapsed, (after.socket_writes - before.socket_writes) / requests);
+    if(failures)
+        printf(", %ld failures", failures);
+    printf("\n");
+
+    for(int fd : fds)
+        close(fd);
+}
+
+int main(){
+    set_log_enabled(false);
+    std::atomic<TCPserver<http_connection<hello_response>>*> server{};
+    std::thread([&server]{
+        auto s = new TCPserver<http_connection<hello_response>>(PORT, 1);
+        s->start();
+        server = s;
+        s->run();
+    }).detach();
+    while(!server)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    for(int depth : {1, 4, 16, 64})
+        bench_depth(server, depth);
+    return 0;
+}
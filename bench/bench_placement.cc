@@ -0,0 +1,177 @@
+/*
+    连接分配策略在倾斜负载下的压测。
+
+    少数长连接（类似websocket）持续发送每条都要处理HEAVY_WORK_US的重消息，其余是
+    一次性的短请求。建立长连接时穿插若干个短连接，轮询分配会把长连接都放到同一个
+    从reactor线程上。之后持续发起短请求，统计它们的往返延迟p50/p99/p999，以及
+    每个loop上的连接数。每种策略在同一进程内各起一个服务器。
+*/
+#include"mrs.h"
+
+#include<chrono>
+#include<thread>
+#include<arpa/inet.h>
+
+typedef std::chrono::steady_clock bench_clock;
+
+static const int LOOP_THREADS = 4;
+static const int HEAVY_CONNECTIONS = 2;
+static const int HEAVY_WORK_US = 500;
+static const int MESSAGE_SIZE = 64;
+static const double DURATION = 2.0;
+
+class skewed_connection : public tcp_connection{
+public:
+    using tcp_connection::tcp_connection;
+
+    int message(buffer* input) override{
+        //'H'开头的是重消息，模拟耗时的业务处理
+        if(input->get_readable_size() && input->get_readable_data()[0] == 'H'){
+            auto until = bench_clock::now() + std::chrono::microseconds(HEAVY_WORK_US);
+            while(bench_clock::now() < until)
+                ;
+        }
+        input->send(this);
+        return 0;
+    }
+};
+
+struct policy_server{
+    const char* name;
+    placement_policy policy;
+    int port;
+    TCPserver<skewed_connection>* server;
+};
+
+static void start_server(policy_server* ps){
+    std::thread([ps]{
+        ps->server = new TCPserver<skewed_connection>(ps->port, LOOP_THREADS);
+        ps->server->set_placement_policy(ps->policy);
+        ps->server->start();
+        ps->server->run();
+    }).detach();
+}
+
+static int connect_to(int port){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    timeval timeout{2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, pointer_cast<sockaddr*>(&addr), sizeof(addr))){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool round_trip(int fd, char kind){
+    char buf[MESSAGE_SIZE];
+    memset(buf, kind, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf))
+        return false;
+    size_t received{};
+    while(received < sizeof(buf)){
+        ssize_t n = ::read(fd, buf, sizeof(buf) - received);
+        if(n <= 0)
+            return false;
+        received += n;
+    }
+    return true;
+}
+
+static void close_reset(int fd){
+    //以RST关闭，避免大量TIME_WAIT
+    linger l{1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+    close(fd);
+}
+
+static bool short_request(int port){
+    int fd = connect_to(port);
+    if(fd == -1)
+        return false;
+    bool ok = round_trip(fd, 's');
+    close_reset(fd);
+    return ok;
+}
+
+static void bench_policy(policy_server* ps){
+    //长连接之间穿插LOOP_THREADS - 1个短连接，等短连接在服务器上释放后再建下一个
+    std::vector<int> heavy_fds;
+    for(int i{}; i != HEAVY_CONNECTIONS; ++i){
+        heavy_fds.push_back(connect_to(ps->port));
+        for(int j{}; j != LOOP_THREADS - 1; ++j)
+            short_request(ps->port);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+
+    std::atomic<bool> stop{};
+    std::vector<std::thread> heavy_clients;
+    for(int fd : heavy_fds)
+        heavy_clients.emplace_back([fd, &stop]{
+            while(!stop.load(std::memory_order_relaxed) && round_trip(fd, 'H'))
+                ;
+        });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    std::vector<double> latency;
+    long failures{};
+    auto start = bench_clock::now();
+    while(std::chrono::duration<double>(bench_clock::now() - start).count() < DURATION){
+        auto begin = bench_clock::now();
+        if(short_request(ps->port))
+            latency.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - begin).count());
+        else
+            ++failures;
+    }
+
+    //结束前记录各个loop上的连接数，长连接此时仍在
+    char placement[128]{};
+    int length{};
+    for(int i{}; i != LOOP_THREADS; ++i)
+        length += snprintf(placement + length, sizeof(placement) - length, "%s%ld",
+                    i ? "/" : "", ps->server->get_thread_pool()->get_event_loop(i)->get_connections());
+
+    stop = true;
+    for(auto& t : heavy_clients)
+        t.join();
+    for(int fd : heavy_fds)
+        if(fd != -1)
+            close_reset(fd);
+
+    if(latency.empty()){
+        printf("%-22s : no request completed\n", ps->name);
+        return;
+    }
+    std::sort(latency.begin(), latency.end());
+    size_t n = latency.size();
+    printf("%-22s : %6zu short requests, p50 %7.1f us, p99 %7.1f us, p999 %7.1f us, connections per loop %s",
+        ps->name, n, latency[n / 2], latency[n * 99 / 100], latency[n * 999 / 1000], placement);
+    if(failures)
+        printf(", %ld failures", failures);
+    printf("\n");
+}
+
+int main(){
+    set_log_enabled(false);
+
+    policy_server servers[] = {
+        {"round-robin", placement_round_robin, 17201, nullptr},
+        {"least-connections", placement_least_connections, 17202, nullptr},
+        {"least-pending-bytes", placement_least_pending_bytes, 17203, nullptr},
+        {"power-of-two-choices", placement_power_of_two, 17204, nullptr},
+    };
+    for(auto& ps : servers)
+        start_server(&ps);
+    //等待服务器开始监听
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+    for(auto& ps : servers)
+        bench_policy(&ps);
+
+    fflush(stdout);
+    _exit(0);
+}
@@ -0,0 +1,78 @@
+/*
+    慢速客户端的请求头解析压测。
+
+    模拟请求头每次只到达一个字节：每收到一个字节就调用一次parse_http_request，
+    直到请求头完整。比较不同请求头大小下平均每个字节的解析耗时：
+    incremental是连接上的用法，不完整时从上次检查过的位置继续；
+    rescan在每次调用前reset，丢掉解析状态，每次都从第一个字节重新解析，代价随大小平方增长。
+*/
+#include"mrs.h"
+
+#include<chrono>
+
+typedef std::chrono::steady_clock bench_clock;
+
+//每种大小至少解析这么多字节，小的请求头重复多次
+static const size_t BYTES_PER_SIZE = 1 << 20;
+
+//请求行之后用X-Pad请求头补足到size字节
+static std::string make_request(size_t size){
+    std::string request = "GET /slow HTTP/1.1\r\nHost: bench\r\n";
+    //每行最多1000字节，最后一行补上剩余部分，空行占2字节
+    while(request.size() + 2 < size){
+        size_t left = size - request.size() - 2;
+        size_t line = left > 1010 ? 1000 : left;
+        request += "X-Pad: " + std::string(line - 9, 'p') + "\r\n";
+    }
+    return request + "\r\n";
+}
+
+//逐字节写入input并解析，返回失败的次数
+static long feed_byte_by_byte(buffer* input, http_request* request, const std::string& text, bool rescan){
+    long failures{};
+    int parsed = -1;
+    for(size_t i{}; i != text.size() && parsed == -1; ++i){
+        input->append(text.data() + i, 1);
+        if(rescan)
+            request->reset();
+        parsed = request->parse_http_request(input, text.size());
+    }
+    if(parsed != 1 || size_t(request->get_length()) != text.size())
+        ++failures;
+    input->consume(input->get_readable_size());
+    request->reset();
+    return failures;
+}
+
+static void bench_size(size_t size){
+    std::string text = make_request(size);
+    buffer input;
+    http_request request;
+    long rounds = std::max<size_t>(1, BYTES_PER_SIZE / text.size());
+    long failures{};
+
+    double ns_per_byte[2];
+    for(int rescan{}; rescan != 2; ++rescan){
+        //rescan时的总量按平方增长，轮数相应减少
+        long n = rescan ? std::max<long>(1, rounds * 1024 / long(text.size())) : rounds;
+        failures += feed_byte_by_byte(&input, &request, text, rescan);
+        auto start = bench_clock::now();
+        for(long i{}; i != n; ++i)
+            failures += feed_byte_by_byte(&input, &request, text, rescan);
+        double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+        ns_per_byte[rescan] = elapsed * 1e9 / (double(n) * text.size());
+    }
+
+    printf("header %6zu bytes : incremental %7.1f ns/byte, rescan %9.1f ns/byte",
+        text.size(), ns_per_byte[0], ns_per_byte[1]);
+    if(failures)
+        printf(", %ld failures", failures);
+    printf("\n");
+}
+
+int main(){
+    set_log_enabled(false);
+    for(size_t size : {512, 1024, 2048, 4096, 8192, 16384, 32768})
+        bench_size(size);
+    return 0;
+}
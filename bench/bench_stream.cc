@@ -0,0 +1,157 @@
+/*
+    流式响应与整体生成响应的对比压测。
+
+    服务器生成RESPONSE_SIZE字节的响应体：buffered在request()中把全部数据写入body，
+    以Content-Length发出；streamed用Transfer-Encoding: chunked，在stream()中按发送缓冲
+    的水位逐块写入。统计客户端收到第一个字节的时间、读完的总时间，以及进程最大常驻
+    内存的增长。每种模式fork一个进程，互不影响内存统计。
+*/
+#include"mrs.h"
+
+#include<chrono>
+#include<thread>
+#include<sys/wait.h>
+#include<sys/resource.h>
+#include<arpa/inet.h>
+
+typedef std::chrono::steady_clock bench_clock;
+
+static const int PORT = 17801;
+static const long RESPONSE_SIZE = 256L << 20;
+static const int BLOCK_SIZE = 64 << 10;
+
+static char block[BLOCK_SIZE];
+
+class buffered_response : public http_response{
+public:
+    int request(http_request* /*a_http_request*/) override{
+        status = ok;
+        status_message = "OK";
+        content_type = "application/octet-stream";
+        for(long i{}; i < RESPONSE_SIZE; i += BLOCK_SIZE)
+            body.append(block, BLOCK_SIZE);
+        return 0;
+    }
+};
+
+//发送缓冲未满时一直写，满了等降到低水位以下再继续
+struct block_producer : std::enable_shared_from_this<block_producer>{
+    std::shared_ptr<http_stream> stream;
+    long left;
+
+    void run(){
+        while(left > 0 && stream->is_writable()){
+            stream->write(block, BLOCK_SIZE);
+            left -= BLOCK_SIZE;
+        }
+        if(stream->is_closed())
+            return;
+        if(left > 0){
+            auto self = shared_from_this();
+            stream->on_writable([self]{ self->run(); });
+        }
+        else
+            stream->finish();
+    }
+};
+
+class streamed_response : public http_response{
+public:
+    int request(http_request* /*a_http_request*/) override{
+        status = ok;
+        status_message = "OK";
+        content_type = "application/octet-stream";
+        stream_body();
+        return 0;
+    }
+
+    int stream(std::shared_ptr<http_stream> a_stream) override{
+        auto producer = std::make_shared<block_producer>();
+        producer->stream = std::move(a_stream);
+        producer->left = RESPONSE_SIZE;
+        producer->run();
+        return 0;
+    }
+};
+
+static int connect_to(int port){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    timeval timeout{10, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, pointer_cast<sockaddr*>(&addr), sizeof(addr))){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static long max_rss_kb(){
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+//读到响应结束为止：Content-Length读满，chunked读到结束块
+static long read_response(int fd, bool chunked, double* first_byte_ms, bench_clock::time_point start){
+    static char buf[1 << 16];
+    long received{};
+    bool first = true;
+    while(true){
+        ssize_t n = ::read(fd, buf, sizeof(buf));
+        if(n <= 0)
+            return -1;
+        if(first){
+            *first_byte_ms = std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+            first = false;
+        }
+        received += n;
+        if(chunked ? n >= 5 && memcmp(buf + n - 5, "0\r\n\r\n", 5) == 0 : received >= RESPONSE_SIZE)
+            return received;
+    }
+}
+
+template<typename RESPONSE>
+static void bench_mode(const char* mode, bool chunked){
+    pid_t pid = fork();
+    if(pid != 0){
+        waitpid(pid, nullptr, 0);
+        return;
+    }
+
+    set_log_enabled(false);
+    std::thread([]{
+        auto server = new TCPserver<http_connection<RESPONSE>>(PORT, 1);
+        server->start();
+        server->run();
+    }).detach();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    long rss_before = max_rss_kb();
+    int fd = connect_to(PORT);
+    const char request[] = "GET /report HTTP/1.1\r\nHost: bench\r\n\r\n";
+    auto start = bench_clock::now();
+    double first_byte_ms{};
+    long received = -1;
+    if(write(fd, request, sizeof(request) - 1) == sizeof(request) - 1)
+        received = read_response(fd, chunked, &first_byte_ms, start);
+    double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+    printf("%-8s : first byte %8.2f ms, total %6.3f s, %7.1f MB/s, max RSS +%ld KB",
+        mode, first_byte_ms, elapsed, RESPONSE_SIZE / elapsed / 1e6, max_rss_kb() - rss_before);
+    if(received < RESPONSE_SIZE)
+        printf(", failed");
+    printf("\n");
+    fflush(stdout);
+    _exit(0);
+}
+
+int main(){
+    memset(block, 'r', sizeof(block));
+    bench_mode<buffered_response>("buffered", false);
+    bench_mode<streamed_response>("streamed", true);
+    return 0;
+}
@@ -0,0 +1,142 @@
+/*
+    流式请求体的上传压测。
+
+    客户端在一个连接上依次上传UPLOAD_SIZE字节的请求体，分别用Content-Length和
+    Transfer-Encoding: chunked，响应只在request_body中累计字节数，不保存数据。
+    统计上传速率、平均和最大的分段大小，以及上传前后进程的最大常驻内存：
+    请求体不在内存中整体缓存，内存的增长与上传大小无关。
+*/
+#include"mrs.h"
+
+#include<chrono>
+#include<thread>
+#include<arpa/inet.h>
+#include<sys/resource.h>
+
+typedef std::chrono::steady_clock bench_clock;
+
+static const int PORT = 17701;
+static const size_t UPLOAD_SIZE = 256 << 20;
+static const size_t WRITE_SIZE = 256 << 10;
+static const size_t CHUNK_SIZE = 16 << 10;
+
+static std::atomic<long> fragments{};
+static std::atomic<long> max_fragment{};
+
+class count_response : public http_response{
+public:
+    int request(http_request* a_http_request) override{
+        a_http_request->set_max_body_size(UPLOAD_SIZE);
+        return 0;
+    }
+
+    int request_body(http_request* /*a_http_request*/, std::string_view data) override{
+        received += data.size();
+        fragments.fetch_add(1, std::memory_order_relaxed);
+        if(long(data.size()) > max_fragment.load(std::memory_order_relaxed))
+            max_fragment.store(data.size(), std::memory_order_relaxed);
+        return 0;
+    }
+
+    int request_completed(http_request* /*a_http_request*/) override{
+        status = ok;
+        status_message = "OK";
+        content_type = "text/plain";
+        body.append_string(received == UPLOAD_SIZE ? "ok\n" : "short\n");
+        return 0;
+    }
+
+private:
+    size_t received{};
+};
+
+static int connect_to(int port){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    timeval timeout{5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, pointer_cast<sockaddr*>(&addr), sizeof(addr))){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool write_all(int fd, const char* data, size_t size){
+    while(size){
+        ssize_t n = write(fd, data, size);
+        if(n <= 0)
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+static long max_rss_kb(){
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+//请求体由WRITE_SIZE大小的写入组成，chunked时每CHUNK_SIZE字节一块
+static void bench_upload(const char* mode, bool chunked){
+    static char payload[WRITE_SIZE];
+    memset(payload, 'u', sizeof(payload));
+    std::string chunk_payload;
+    for(size_t i{}; i != WRITE_SIZE / CHUNK_SIZE; ++i){
+        char size_line[32];
+        snprintf(size_line, sizeof(size_line), "%zx\r\n", CHUNK_SIZE);
+        chunk_payload += size_line;
+        chunk_payload.append(payload, CHUNK_SIZE);
+        chunk_payload += "\r\n";
+    }
+
+    int fd = connect_to(PORT);
+    char head[128];
+    if(chunked)
+        snprintf(head, sizeof(head), "POST /upload HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n");
+    else
+        snprintf(head, sizeof(head), "POST /upload HTTP/1.1\r\nContent-Length: %zu\r\n\r\n", UPLOAD_SIZE);
+
+    fragments = 0;
+    max_fragment = 0;
+    long rss_before = max_rss_kb();
+    auto start = bench_clock::now();
+    bool written = write_all(fd, head, strlen(head));
+    for(size_t sent{}; written && sent < UPLOAD_SIZE; sent += WRITE_SIZE)
+        written = chunked ? write_all(fd, chunk_payload.data(), chunk_payload.size()) :
+            write_all(fd, payload, WRITE_SIZE);
+    if(written && chunked)
+        written = write_all(fd, "0\r\n\r\n", 5);
+
+    char response[256];
+    ssize_t n = written ? read(fd, response, sizeof(response) - 1) : -1;
+    double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+    response[std::max<ssize_t>(n, 0)] = 0;
+
+    printf("%-14s : %7.1f MB/s, %ld fragments, %.0f bytes/fragment avg, %ld max, max RSS +%ld KB",
+        mode, UPLOAD_SIZE / elapsed / 1e6, fragments.load(), double(UPLOAD_SIZE) / std::max(1L, fragments.load()),
+        max_fragment.load(), max_rss_kb() - rss_before);
+    if(!strstr(response, "ok\n"))
+        printf(", failed");
+    printf("\n");
+    close(fd);
+}
+
+int main(){
+    set_log_enabled(false);
+    std::thread([]{
+        auto server = new TCPserver<http_connection<count_response>>(PORT, 1);
+        server->start();
+        server->run();
+    }).detach();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    bench_upload("content-length", false);
+    bench_upload("chunked", true);
+    return 0;
+}
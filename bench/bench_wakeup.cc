@@ -0,0 +1,168 @@
+/*
+    跨线程交付channel的唤醒压测。
+
+    latency：生产者线程向运行中的event_loop交付一个已可读的eventfd channel，
+             从add_channel_event调用到该channel的read被回调之间的时间，逐个往返测量。
+    burst  ：一次性交付一批channel，统计实际的eventfd write次数和全部处理完的耗时。
+    tasks  ：一次性用queue_in_loop投递一批loop_task，统计eventfd write次数、投递期间
+             的内存分配次数、耗时以及event_loop每轮执行的任务数。
+    两项分别在普通的阻塞dispatch和开启busy poll的event_loop上运行，并输出event_loop的计数。
+*/
+#include"mrs.h"
+
+#include<chrono>
+#include<algorithm>
+#include<new>
+
+typedef std::chrono::steady_clock bench_clock;
+
+static std::atomic<long> handled{};
+static std::atomic<long> allocations{};
+static long checksum{};
+static bench_clock::time_point handled_at;
+
+class readable_channel : public channel{
+public:
+    readable_channel(int a_fd, event_loop* a_event_loop) : channel(a_fd, EVENT_READ, a_event_loop) {}
+
+    int read() override{
+        handled_at = bench_clock::now();
+        handled.fetch_add(1, std::memory_order_release);
+        //返回非0，由channel_map关闭并释放
+        return 1;
+    }
+};
+
+//统计全部的operator new调用
+void* operator new(size_t size){
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if(void* p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept{
+    free(p);
+}
+
+static readable_channel* make_readable_channel(event_loop* loop){
+    int fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+    return new readable_channel(fd, loop);
+}
+
+static void wait_handled(long n){
+    while(handled.load(std::memory_order_acquire) < n)
+        sched_yield();
+}
+
+static void bench_latency(event_loop* loop, int samples){
+    std::vector<double> latency;
+    for(int i{}; i != samples; ++i){
+        readable_channel* cc = make_readable_channel(loop);
+        long target = handled.load() + 1;
+
+        auto start = bench_clock::now();
+        loop->add_channel_event(cc->get_fd(), cc);
+        wait_handled(target);
+        latency.push_back(std::chrono::duration<double, std::micro>(handled_at - start).count());
+    }
+    std::sort(latency.begin(), latency.end());
+    printf("latency %d hand-offs: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+        samples, latency[samples / 2], latency[samples * 99 / 100], latency.back());
+}
+
+static void bench_burst(event_loop* loop, int burst){
+    std::vector<readable_channel*> channels;
+    for(int i{}; i != burst; ++i)
+        channels.push_back(make_readable_channel(loop));
+
+    long writes = loop->get_wakeup_writes();
+    long target = handled.load() + burst;
+
+    auto start = bench_clock::now();
+    for(auto cc : channels)
+        loop->add_channel_event(cc->get_fd(), cc);
+    wait_handled(target);
+    double elapsed = std::chrono::duration<double, std::micro>(handled_at - start).count();
+
+    printf("burst   %d hand-offs: %ld wakeup writes, %.1f us total, %.2f us per hand-off\n",
+        burst, loop->get_wakeup_writes() - writes, elapsed, elapsed / burst);
+}
+
+static void bench_tasks(event_loop* loop, int burst){
+    //先让交替使用的两个任务队列的容量都增长到位，之后的投递不再扩容
+    long target;
+    for(int round{}; round != 2; ++round){
+        target = handled.load() + burst;
+        for(int i{}; i != burst; ++i)
+            loop->queue_in_loop([]{ handled.fetch_add(1, std::memory_order_release); });
+        wait_handled(target);
+    }
+
+    long writes = loop->get_wakeup_writes();
+    event_loop_stats before = loop->get_stats();
+    target = handled.load() + burst;
+
+    auto start = bench_clock::now();
+    long allocated = allocations.load(std::memory_order_relaxed);
+    for(int i{}; i != burst; ++i){
+        //捕获32字节，仍在loop_task的内部缓冲区中
+        long a = i, b = i + 1, c = i + 2, d = i + 3;
+        loop->queue_in_loop([a, b, c, d]{
+            checksum += a + b + c + d;
+            handled_at = bench_clock::now();
+            handled.fetch_add(1, std::memory_order_release);
+        });
+    }
+    allocated = allocations.load(std::memory_order_relaxed) - allocated;
+    wait_handled(target);
+    double elapsed = std::chrono::duration<double, std::micro>(handled_at - start).count();
+    event_loop_stats after = loop->get_stats();
+
+    printf("tasks   %d posts: %ld wakeup writes, %ld allocations, %.1f us total, %ld batches, max batch %ld\n",
+        burst, loop->get_wakeup_writes() - writes, allocated, elapsed,
+        after.task_batches - before.task_batches, after.max_task_batch);
+}
+
+static void print_stats(event_loop* loop, const event_loop_stats& before, double seconds){
+    event_loop_stats after = loop->get_stats();
+    printf("stats   %.0f wakeups/s, %ld dispatches, busy poll %ld hits / %ld misses, %.1f ms spinning\n",
+        (after.wakeups - before.wakeups) / seconds, after.dispatches - before.dispatches,
+        after.busy_poll_hits - before.busy_poll_hits, after.busy_poll_misses - before.busy_poll_misses,
+        (after.busy_poll_ns - before.busy_poll_ns) / 1e6);
+}
+
+static void bench_loop(const char* title, event_loop* loop){
+    printf("[%s]\n", title);
+    event_loop_stats before = loop->get_stats();
+    auto start = bench_clock::now();
+
+    bench_latency(loop, 10000);
+    for(int burst : {10, 100, 1000})
+        bench_burst(loop, burst);
+    for(int burst : {10, 100, 1000})
+        bench_tasks(loop, burst);
+
+    print_stats(loop, before, std::chrono::duration<double>(bench_clock::now() - start).count());
+}
+
+int main(){
+    set_log_enabled(false);
+
+    event_loop_thread loop_thread;
+    bench_loop("blocking dispatch", loop_thread.start(0));
+
+    //阻塞前先空转，交付落在空转期间时省去一次睡眠和唤醒
+    event_loop_options options;
+    options.busy_poll_us = 200;
+    event_loop_thread busy_loop_thread;
+    bench_loop("busy poll 200 us", busy_loop_thread.start(1, options));
+
+    //event_loop线程没有退出机制，直接结束进程
+    fflush(stdout);
+    _exit(0);
+}
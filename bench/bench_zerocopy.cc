@@ -0,0 +1,180 @@
+/*
+    MSG_ZEROCOPY发送与普通复制发送的对比压测。
+
+    每种模式fork一个服务器进程，客户端每发一个字节，服务器就以append_reference
+    不复制地回送一个PAYLOAD_SIZE字节的响应体。统计吞吐量，以及服务器进程每发送
+    一个字节消耗的CPU时间（用户态+内核态），服务器进程通过管道回报自己的计数。
+    回环接口上内核投递到本机套接字时仍要复制页面，完成通知会带有
+    SO_EE_CODE_ZEROCOPY_COPIED，结果中的copied一项反映了这一点；
+    真正省去复制需要经过网卡发送。
+*/
+#include"mrs.h"
+
+#include<chrono>
+#include<thread>
+#include<sys/wait.h>
+#include<sys/resource.h>
+#include<arpa/inet.h>
+
+typedef std::chrono::steady_clock bench_clock;
+
+static const int CONNECTIONS = 4;
+static const long PAYLOAD_SIZE = 1 << 20;
+static const int WARMUP_REQUESTS = 64;
+static const int REQUESTS = 1024;
+static const long ZEROCOPY_THRESHOLD = 65536;
+
+static char payload[PAYLOAD_SIZE];
+
+class payload_connection : public tcp_connection{
+public:
+    using tcp_connection::tcp_connection;
+
+    int message(buffer* input) override{
+        int size = input->get_readable_size();
+        input->consume(size);
+        for(int i{}; i != size; ++i){
+            chain_buffer response;
+            response.append_reference(payload, PAYLOAD_SIZE);
+            send_chain(&response);
+        }
+        return 0;
+    }
+};
+
+struct server_sample{
+    long cpu_ns;
+    long sends;
+    long completions;
+    long copied;
+};
+
+static server_sample take_sample(){
+    server_sample sample{};
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    sample.cpu_ns = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000L +
+        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000L;
+    sample.sends = zerocopy_sender::get_sends();
+    sample.completions = zerocopy_sender::get_completions();
+    sample.copied = zerocopy_sender::get_copied();
+    return sample;
+}
+
+static void serve(int port, long threshold, int command_fd, int reply_fd){
+    set_log_enabled(false);
+    std::thread([port, threshold]{
+        auto server = new TCPserver<payload_connection>(port, 1);
+        server->set_zerocopy_threshold(threshold);
+        server->start();
+        server->run();
+    }).detach();
+
+    //每收到一个字节回报一次计数，管道关闭时退出
+    char command;
+    while(read(command_fd, &command, 1) == 1){
+        server_sample sample = take_sample();
+        if(write(reply_fd, &sample, sizeof(sample)) != sizeof(sample))
+            break;
+    }
+    _exit(0);
+}
+
+static int connect_to(int port){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    timeval timeout{5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, pointer_cast<sockaddr*>(&addr), sizeof(addr))){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//每个连接上同时有一个请求在途，返回失败的请求数
+static long run_requests(int* fds, int requests){
+    static char sink[1 << 16];
+    long failures{};
+    for(int i{}; i < requests; i += CONNECTIONS){
+        for(int c{}; c != CONNECTIONS; ++c)
+            if(write(fds[c], "x", 1) != 1)
+                ++failures;
+        for(int c{}; c != CONNECTIONS; ++c){
+            long left = PAYLOAD_SIZE;
+            while(left > 0){
+                ssize_t n = ::read(fds[c], sink, std::min<long>(left, sizeof(sink)));
+                if(n <= 0){
+                    ++failures;
+                    break;
+                }
+                left -= n;
+            }
+        }
+    }
+    return failures;
+}
+
+static void bench_mode(const char* mode, int port, long threshold){
+    int command_pipe[2], reply_pipe[2];
+    if(pipe(command_pipe) || pipe(reply_pipe)){
+        perror("pipe");
+        return;
+    }
+    pid_t pid = fork();
+    if(pid == 0){
+        close(command_pipe[1]);
+        close(reply_pipe[0]);
+        serve(port, threshold, command_pipe[0], reply_pipe[1]);
+    }
+    close(command_pipe[0]);
+    close(reply_pipe[1]);
+
+    auto sample = [&]{
+        server_sample s{};
+        if(write(command_pipe[1], "s", 1) != 1 || read(reply_pipe[0], &s, sizeof(s)) != sizeof(s))
+            fprintf(stderr, "server sample failed\n");
+        return s;
+    };
+    //等待服务器开始监听
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+    int fds[CONNECTIONS];
+    for(int& fd : fds)
+        fd = connect_to(port);
+    long failures = run_requests(fds, WARMUP_REQUESTS);
+
+    server_sample before = sample();
+    auto start = bench_clock::now();
+    failures += run_requests(fds, REQUESTS);
+    double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+    //等最后的完成通知到达
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    server_sample after = sample();
+
+    double bytes = double(REQUESTS) * PAYLOAD_SIZE;
+    printf("%-8s : %8.1f MB/s, server %.3f ns CPU/byte, zerocopy sends %ld, completions %ld, copied %ld",
+        mode, bytes / elapsed / 1e6, (after.cpu_ns - before.cpu_ns) / bytes,
+        after.sends - before.sends, after.completions - before.completions,
+        after.copied - before.copied);
+    if(failures)
+        printf(", %ld failures", failures);
+    printf("\n");
+
+    for(int fd : fds)
+        close(fd);
+    close(command_pipe[1]);
+    close(reply_pipe[0]);
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+}
+
+int main(){
+    memset(payload, 'z', sizeof(payload));
+    bench_mode("copy", 17401, 0);
+    bench_mode("zerocopy", 17402, ZEROCOPY_THRESHOLD);
+    return 0;
+}
@@ -38,27 +38,31 @@ public:
         
     }
     int request(http_request* a_http_request)override {
-        char* url = a_http_request->get_url();
-        const char* path = a_http_request->get_path();
+        std::string_view path = a_http_request->get_path();
 
         const char* root = "/root/Test/public";
         const char* index = "index.html";
 
         char u[1024];
+        //路径只是请求头中的视图，不以0结尾
+        if(path.empty() || path.size() > sizeof(u) - strlen(root) - strlen(index) - 2)
+            path = "/";
         strcpy(u, root);
-        strcat(u, path);
+        strncat(u, path.data(), path.size());
 
-        log_msg("[request path] %s\n", path);
+        log_msg("[request path] %.*s\n", int(path.size()), path.data());
         
         int f = is_file(u);
         if(!f){
-            if(path[strlen(path) - 1] != '/')
+            if(path.back() != '/')
                 strcat(u, "/");
             strcat(u, index);
             f = is_file(u);
         }
        if(f){        
-            int fd = open(u, O_RDONLY);
+            int fd = open(u, O_RDONLY | O_CLOEXEC);
+            struct stat st{};
+            fstat(fd, &st);
 
             status = ok;
             status_message = "OK";
@@ -66,16 +70,9 @@ public:
             const char* ext = get_extension(u);
             content_type = get_content_type(ext);
             
-            char s[10001];
-            int nread;
-            int sumread = 0;
+            //文件内容由连接以sendfile发出，fd随body一起释放
             body.clear();
-            while((nread = read(fd, s, 10000)) > 0){
-                sumread += nread;
-                s[nread] = 0;
-                body.append(s, nread);
-
-            }
+            body.append_file(fd, 0, st.st_size);
         }
         else{
             status = not_found;
@@ -0,0 +1,98 @@
+#include"buffer_pool.h"
+
+std::atomic<bool> buffer_pool::enabled{true};
+std::atomic<long> buffer_pool::heap_allocations{};
+
+buffer_pool& buffer_pool::local(){
+    static thread_local buffer_pool pool;
+    return pool;
+}
+
+buffer_pool::buffer_pool() :
+    free_lists{},
+    cached_counts{},
+    scratch(nullptr)
+{}
+
+buffer_pool::~buffer_pool(){
+    for(int i{}; i != BUFFER_SIZE_CLASSES; ++i)
+        while(free_lists[i]){
+            free_block* next = free_lists[i]->next;
+            delete[] pointer_cast<char*>(free_lists[i]);
+            free_lists[i] = next;
+        }
+    delete[] scratch;
+}
+
+int buffer_pool::size_class(int size){
+    int index{};
+    for(int block = BUFFER_MIN_BLOCK; block < size; block <<= 1)
+        ++index;
+    return index;
+}
+
+char* buffer_pool::acquire(int size, int& block_size){
+    if(!is_enabled() || size > BUFFER_MAX_POOLED_BLOCK){
+        block_size = size;
+        heap_allocations.fetch_add(1, std::memory_order_relaxed);
+        return new char[size];
+    }
+
+    int index = size_class(size);
+    block_size = BUFFER_MIN_BLOCK << index;
+    if(free_block* block = free_lists[index]){
+        free_lists[index] = block->next;
+        --cached_counts[index];
+        return pointer_cast<char*>(block);
+    }
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    return new char[block_size];
+}
+
+void buffer_pool::release(char* block, int block_size){
+    if(!block)
+        return;
+    //关闭时分配的块大小不一定是某个级别的大小
+    if(!is_enabled() || block_size > BUFFER_MAX_POOLED_BLOCK ||
+        block_size != BUFFER_MIN_BLOCK << size_class(block_size)){
+        delete[] block;
+        return;
+    }
+
+    int index = size_class(block_size);
+    if(size_t(cached_counts[index] + 1) * block_size > BUFFER_POOL_CLASS_CACHE){
+        delete[] block;
+        return;
+    }
+    free_block* node = pointer_cast<free_block*>(block);
+    node->next = free_lists[index];
+    free_lists[index] = node;
+    ++cached_counts[index];
+}
+
+char* buffer_pool::get_scratch(){
+    if(!scratch){
+        heap_allocations.fetch_add(1, std::memory_order_relaxed);
+        scratch = new char[BUFFER_SCRATCH_SIZE];
+    }
+    return scratch;
+}
+
+size_t buffer_pool::get_cached_bytes(){
+    size_t bytes{};
+    for(int i{}; i != BUFFER_SIZE_CLASSES; ++i)
+        bytes += size_t(cached_counts[i]) * (BUFFER_MIN_BLOCK << i);
+    return bytes;
+}
+
+void buffer_pool::set_enabled(bool a_enabled){
+    enabled.store(a_enabled, std::memory_order_relaxed);
+}
+
+bool buffer_pool::is_enabled(){
+    return enabled.load(std::memory_order_relaxed);
+}
+
+long buffer_pool::get_heap_allocations(){
+    return heap_allocations.load(std::memory_order_relaxed);
+}
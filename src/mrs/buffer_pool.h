@@ -0,0 +1,62 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include"common.h"
+
+//数据块的大小级别从BUFFER_MIN_BLOCK起按2倍增长，超过BUFFER_MAX_POOLED_BLOCK的直接分配
+const int BUFFER_MIN_BLOCK = 1024;
+const int BUFFER_MAX_POOLED_BLOCK = 65536;
+const int BUFFER_SIZE_CLASSES = 7;
+//每个级别缓存的空闲块总大小上限，超出的直接释放
+const size_t BUFFER_POOL_CLASS_CACHE = 4 * 1024 * 1024;
+//socket_read中放不下的数据先读到线程的临时区
+const int BUFFER_SCRATCH_SIZE = 65536;
+
+class buffer_pool{
+/*
+    buffer数据块的线程本地空闲链表，每个event_loop线程一个，取用和归还都不加锁。
+    块在哪个线程中归还就进入哪个线程的链表，稳定运行时读写请求不再分配堆内存。
+    关闭后按原来的方式，buffer在构造时就从堆上分配INIT_BUFFER_SIZE的空间。
+*/
+public:
+    static buffer_pool& local();
+
+    //返回至少size字节的块，实际大小写入block_size
+    char* acquire(int size, int& block_size);
+
+    //block_size必须是acquire时得到的大小
+    void release(char* block, int block_size);
+
+    char* get_scratch();
+
+    //本线程链表中缓存的字节数
+    size_t get_cached_bytes();
+
+    //需要在服务器启动前设置
+    static void set_enabled(bool enabled);
+
+    static bool is_enabled();
+
+    //所有线程中向堆申请数据块的次数
+    static long get_heap_allocations();
+
+private:
+    buffer_pool();
+
+    ~buffer_pool();
+
+    struct free_block{
+        free_block* next;
+    };
+
+    static int size_class(int size);
+
+    free_block* free_lists[BUFFER_SIZE_CLASSES];
+    int cached_counts[BUFFER_SIZE_CLASSES];
+    char* scratch;
+
+    static std::atomic<bool> enabled;
+    static std::atomic<long> heap_allocations;
+};
+
+#endif
@@ -0,0 +1,470 @@
+#include"chain_buffer.h"
+
+#include<sys/sendfile.h>
+#include<linux/errqueue.h>//sock_extended_err
+
+chain_buffer::chain_buffer() :
+    head(nullptr),
+    tail(nullptr),
+    readable_size{}
+{}
+
+chain_buffer::~chain_buffer(){
+    clear();
+}
+
+long chain_buffer::get_readable_size(){
+    return readable_size;
+}
+
+bool chain_buffer::empty(){
+    return readable_size == 0;
+}
+
+int chain_buffer::append(const void* a_data, int size){
+    if(!a_data || size <= 0)
+        return {};
+
+    const char* from = static_cast<const char*>(a_data);
+    while(size > 0){
+        //末尾是还有空间的数据块就接着写，否则新取一块
+        if(!tail || !tail->block_size || tail->end == tail->capacity){
+            int block_size;
+            char* block = buffer_pool::local().acquire(CHAIN_BLOCK_SIZE, block_size);
+            segment* s = new(block) segment{nullptr, block + sizeof(segment), 0, 0,
+                                            int(block_size - sizeof(segment)), block_size, nullptr, -1, 0, 0, nullptr, 0};
+            push_segment(s);
+        }
+        int n = std::min(size, tail->capacity - tail->end);
+        memcpy(tail->data + tail->end, from, n);
+        tail->end += n;
+        from += n;
+        size -= n;
+        readable_size += n;
+    }
+    return {};
+}
+
+int chain_buffer::append_string(const char* s){
+    if(s)
+        append(s, strlen(s));
+    return {};
+}
+
+int chain_buffer::append_char(char c){
+    return append(&c, 1);
+}
+
+int chain_buffer::append_reference(const void* a_data, int size, std::function<void()> release){
+    if(!a_data || size <= 0){
+        if(release)
+            release();
+        return {};
+    }
+    push_segment(new segment{nullptr, const_cast<char*>(static_cast<const char*>(a_data)), 0, size,
+                            size, 0, std::move(release), -1, 0, 0, nullptr, 0});
+    readable_size += size;
+    return {};
+}
+
+int chain_buffer::append_file(int fd, off_t offset, long length){
+    if(length <= 0){
+        close(fd);
+        return 0;
+    }
+
+    if(length <= CHAIN_FILE_COPY_LIMIT){
+        char data[CHAIN_FILE_COPY_LIMIT];
+        long done{};
+        while(done < length){
+            ssize_t n = pread(fd, data + done, length - done, offset + done);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0){
+                close(fd);
+                return -1;
+            }
+            done += n;
+        }
+        close(fd);
+        return append(data, length);
+    }
+
+    push_segment(new segment{nullptr, nullptr, 0, 0, 0, 0, nullptr, fd, offset, length, nullptr, 0});
+    readable_size += length;
+    return 0;
+}
+
+void chain_buffer::append_chain(chain_buffer& other){
+    if(&other == this || !other.head)
+        return;
+    if(tail)
+        tail->next = other.head;
+    else
+        head = other.head;
+    tail = other.tail;
+    readable_size += other.readable_size;
+
+    other.head = nullptr;
+    other.tail = nullptr;
+    other.readable_size = 0;
+}
+
+int chain_buffer::get_iovecs(iovec* vec, int max_count){
+    int count{};
+    for(segment* s = head; s && count < max_count; s = s->next){
+        if(s->file_fd != -1)
+            break;
+        if(s->end == s->begin)
+            continue;
+        vec[count].iov_base = s->data + s->begin;
+        vec[count].iov_len = s->end - s->begin;
+        ++count;
+    }
+    return count;
+}
+
+void chain_buffer::consume(long size){
+    //全部发完时末尾的块也还给buffer_pool，空闲的连接不占用数据块
+    if(size >= readable_size){
+        clear();
+        return;
+    }
+    readable_size -= size;
+    while(size > 0){
+        if(head->file_fd != -1){
+            long n = std::min(size, head->file_length);
+            head->file_offset += n;
+            head->file_length -= n;
+            size -= n;
+            if(!head->file_length){
+                segment* next = head->next;
+                release_segment(head);
+                head = next;
+            }
+            continue;
+        }
+        long n = std::min<long>(size, head->end - head->begin);
+        head->begin += n;
+        size -= n;
+        if(head->begin == head->end){
+            segment* next = head->next;
+            release_segment(head);
+            head = next;
+        }
+    }
+}
+
+long chain_buffer::write_to(int fd, zerocopy_sender* zerocopy, long* syscalls){
+    iovec vec[CHAIN_MAX_IOVECS];
+    long total{};
+    long calls{};
+    if(!syscalls)
+        syscalls = &calls;
+    while(!empty()){
+        if(head->file_fd != -1){
+            long n = send_file_segment(fd, *syscalls);
+            if(n < 0)
+                return total ? total : -1;
+            total += n;
+            if(head && head->file_fd != -1)
+                break;
+            continue;
+        }
+
+        int count = get_iovecs(vec, CHAIN_MAX_IOVECS);
+        size_t expected{};
+        for(int i{}; i != count; ++i)
+            expected += vec[i].iov_len;
+
+        //与writev相同，MSG_NOSIGNAL避免对端关闭后写入时收到SIGPIPE。
+        //这次发不完全部数据（后面是文件段、或超出CHAIN_MAX_IOVECS）时用MSG_MORE，
+        //响应头和文件的开头可以合成一个TCP报文
+        msghdr msg{};
+        msg.msg_iov = vec;
+        msg.msg_iovlen = count;
+        int flags = MSG_NOSIGNAL;
+        if(readable_size > long(expected))
+            flags |= MSG_MORE;
+        bool use_zerocopy = zerocopy && zerocopy->is_enabled() && long(expected) >= zerocopy->get_threshold();
+        ssize_t n = sendmsg(fd, &msg, use_zerocopy ? flags | MSG_ZEROCOPY : flags);
+        ++*syscalls;
+        //超出optmem限制等，这一次退回复制发送
+        if(n < 0 && use_zerocopy && errno == ENOBUFS){
+            use_zerocopy = false;
+            n = sendmsg(fd, &msg, flags);
+            ++*syscalls;
+        }
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return total ? total : -1;
+        }
+        if(use_zerocopy)
+            mark_zerocopy(n, zerocopy, zerocopy->next_send_seq());
+        consume(n);
+        total += n;
+        //只写出一部分说明套接字缓冲区已满，不必再试一次得到EAGAIN
+        if(size_t(n) < expected)
+            break;
+    }
+    return total;
+}
+
+long chain_buffer::send_file_segment(int fd, long& syscalls){
+    /*
+        文件区间从page cache直接发出，只发出一部分时说明套接字缓冲区已满，由调用者
+        等待下一次EPOLLOUT。返回发出的字节数，套接字已满时为0，出错时返回-1。
+    */
+    long total{};
+    while(head && head->file_fd != -1){
+        off_t offset = head->file_offset;
+        size_t count = std::min<long>(head->file_length, 0x7ffff000);
+        ssize_t n = sendfile(fd, head->file_fd, &offset, count);
+        ++syscalls;
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return total;
+            return -1;
+        }
+        if(n == 0){
+            //文件在发送期间被截短，已经无法发出声明的长度
+            errno = EIO;
+            return -1;
+        }
+        consume(n);
+        total += n;
+        if(size_t(n) < count)
+            return total;
+    }
+    return total;
+}
+
+void chain_buffer::clear(){
+    while(head){
+        segment* next = head->next;
+        release_segment(head);
+        head = next;
+    }
+    tail = nullptr;
+    readable_size = 0;
+}
+
+void chain_buffer::mark_zerocopy(long size, zerocopy_sender* zerocopy, uint32_t seq){
+    for(segment* s = head; s && size > 0; s = s->next){
+        s->zerocopy = zerocopy;
+        s->zerocopy_seq = seq;
+        size -= s->end - s->begin;
+    }
+}
+
+void chain_buffer::release_segment(segment* s){
+    //内核可能还在读取它的内存
+    if(s->zerocopy && !s->zerocopy->is_completed(s->zerocopy_seq)){
+        s->zerocopy->hold(s);
+        return;
+    }
+    if(s->file_fd != -1){
+        close(s->file_fd);
+        delete s;
+    }
+    else if(s->block_size){
+        int block_size = s->block_size;
+        s->~segment();
+        buffer_pool::local().release(pointer_cast<char*>(s), block_size);
+    }
+    else{
+        if(s->release)
+            s->release();
+        delete s;
+    }
+}
+
+void chain_buffer::push_segment(segment* s){
+    if(tail)
+        tail->next = s;
+    else
+        head = s;
+    tail = s;
+}
+
+//zerocopy_sender
+std::atomic<long> zerocopy_sender::sends{};
+std::atomic<long> zerocopy_sender::completions{};
+std::atomic<long> zerocopy_sender::copied{};
+
+zerocopy_sender::zerocopy_sender() :
+    threshold{},
+    next_seq{},
+    completed_seq{},
+    early_ranges{},
+    held_head(nullptr),
+    held_tail(nullptr),
+    held_count{},
+    abandoned{}
+{}
+
+zerocopy_sender::~zerocopy_sender(){
+    //有未完成的发送时由event_loop接管，等到全部完成才释放，这里持有的段都已完成
+    assert(!has_outstanding() || !held_head);
+    while(held_head){
+        chain_buffer::segment* next = held_head->next;
+        held_head->zerocopy = nullptr;
+        chain_buffer::release_segment(held_head);
+        held_head = next;
+    }
+}
+
+int zerocopy_sender::enable(int fd, long a_threshold){
+    threshold = 0;
+    if(a_threshold <= 0)
+        return 0;
+    int one = 1;
+    if(setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+        return -1;
+    threshold = a_threshold;
+    return 0;
+}
+
+bool zerocopy_sender::is_enabled(){
+    return threshold > 0;
+}
+
+long zerocopy_sender::get_threshold(){
+    return threshold;
+}
+
+int zerocopy_sender::reap(int fd){
+    while(1){
+        char control[128];
+        msghdr msg{};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(fd, &msg, MSG_ERRQUEUE) < 0){
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+
+        for(cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)){
+            if(!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cm), sizeof(err));
+            if(err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno){
+                errno = err.ee_errno ? err.ee_errno : EIO;
+                return -1;
+            }
+            //ee_info到ee_data（含）之间的发送都已完成
+            if(err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                copied.fetch_add(err.ee_data - err.ee_info + 1, std::memory_order_relaxed);
+            complete(err.ee_info, err.ee_data);
+        }
+    }
+    release_completed();
+    //不读SO_ERROR，读取会清掉套接字上的错误，连接本身的错误留给之后的读写报告
+    return 0;
+}
+
+size_t zerocopy_sender::get_held_count(){
+    return held_count;
+}
+
+bool zerocopy_sender::has_outstanding(){
+    return !abandoned && completed_seq != next_seq;
+}
+
+void zerocopy_sender::abandon(){
+    //段的内存可能仍在被内核读取，宁可泄漏也不还给buffer_pool
+    abandoned = true;
+    held_head = held_tail = nullptr;
+    held_count = 0;
+}
+
+long zerocopy_sender::get_sends(){
+    return sends.load(std::memory_order_relaxed);
+}
+
+long zerocopy_sender::get_completions(){
+    return completions.load(std::memory_order_relaxed);
+}
+
+long zerocopy_sender::get_copied(){
+    return copied.load(std::memory_order_relaxed);
+}
+
+uint32_t zerocopy_sender::next_send_seq(){
+    sends.fetch_add(1, std::memory_order_relaxed);
+    return next_seq++;
+}
+
+bool zerocopy_sender::is_completed(uint32_t seq){
+    //序号会回绕，按差值比较
+    return int32_t(seq - completed_seq) < 0;
+}
+
+void zerocopy_sender::complete(uint32_t lo, uint32_t hi){
+    completions.fetch_add(hi - lo + 1, std::memory_order_relaxed);
+    if(int32_t(lo - completed_seq) > 0){
+        early_ranges.emplace_back(lo, hi);
+        return;
+    }
+    if(int32_t(hi + 1 - completed_seq) > 0)
+        completed_seq = hi + 1;
+
+    //先到的区间与已完成的部分接上了
+    for(bool merged = true; merged;){
+        merged = false;
+        for(size_t i{}; i < early_ranges.size(); ++i){
+            if(int32_t(early_ranges[i].first - completed_seq) <= 0){
+                if(int32_t(early_ranges[i].second + 1 - completed_seq) > 0)
+                    completed_seq = early_ranges[i].second + 1;
+                early_ranges[i] = early_ranges.back();
+                early_ranges.pop_back();
+                merged = true;
+                break;
+            }
+        }
+    }
+}
+
+void zerocopy_sender::hold(chain_buffer::segment* s){
+    if(abandoned)
+        return;
+    s->next = nullptr;
+    if(held_tail)
+        held_tail->next = s;
+    else
+        held_head = s;
+    held_tail = s;
+    ++held_count;
+}
+
+void zerocopy_sender::release_completed(){
+    chain_buffer::segment* previous = nullptr;
+    chain_buffer::segment* s = held_head;
+    while(s){
+        chain_buffer::segment* next = s->next;
+        if(is_completed(s->zerocopy_seq)){
+            if(previous)
+                previous->next = next;
+            else
+                held_head = next;
+            if(s == held_tail)
+                held_tail = previous;
+            --held_count;
+            s->zerocopy = nullptr;
+            chain_buffer::release_segment(s);
+        }
+        else
+            previous = s;
+        s = next;
+    }
+}
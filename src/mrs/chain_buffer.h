@@ -0,0 +1,181 @@
+#ifndef CHAIN_BUFFER_H
+#define CHAIN_BUFFER_H
+
+#include"common.h"
+#include"buffer_pool.h"
+
+#include<climits>//IOV_MAX
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+//数据块的大小，取自buffer_pool中的一个级别
+const int CHAIN_BLOCK_SIZE = 16384;
+//一次writev最多的段数
+const int CHAIN_MAX_IOVECS = IOV_MAX;
+//不超过该长度的文件直接读入数据块，和前后的数据一起聚集写，省去一次sendfile
+const long CHAIN_FILE_COPY_LIMIT = 16384;
+
+class zerocopy_sender;
+
+class chain_buffer{
+/*
+    由若干段组成的单链表输出缓冲区。段是从buffer_pool取得的定长数据块、对外部内存的引用，
+    或者以sendfile发送的文件区间。
+    追加时只写入末尾的块或新增段，已有的数据不会被移动；整个链可以不复制地移到另一个
+    chain_buffer的末尾。发送时一次聚集写最多CHAIN_MAX_IOVECS段。
+*/
+public:
+    chain_buffer();
+
+    chain_buffer(const chain_buffer&) = delete;
+
+    chain_buffer& operator=(const chain_buffer&) = delete;
+
+    ~chain_buffer();
+
+    long get_readable_size();
+
+    bool empty();
+
+    int append(const void* a_data, int size);
+
+    int append_string(const char* s);
+
+    int append_char(char c);
+
+    //引用外部内存而不复制，内存在数据发出或丢弃之前必须有效，之后调用release
+    int append_reference(const void* a_data, int size, std::function<void()> release = nullptr);
+
+    /*
+        追加文件fd中从offset开始的length字节，fd由chain_buffer负责关闭。
+        较大的文件在发送时以sendfile从page cache直接发出，不经过用户空间。
+        读取失败时关闭fd并返回-1。
+    */
+    int append_file(int fd, off_t offset, long length);
+
+    //把other的全部段移到末尾，other变为空
+    void append_chain(chain_buffer& other);
+
+    //从头开始填充至多max_count个iovec，遇到文件段时停止，返回填充的个数
+    int get_iovecs(iovec* vec, int max_count);
+
+    //丢弃前size字节，数据块还给buffer_pool
+    void consume(long size);
+
+    /*
+        向套接字聚集写，直到全部发出、或套接字缓冲区已满。返回发出的字节数，出错时返回-1。
+        zerocopy不为空且一次发送的字节数达到它的阈值时以MSG_ZEROCOPY发送，发出的段
+        在内核通知完成之前由zerocopy持有。
+        syscalls不为空时累加其中发起的sendmsg、sendfile次数。
+    */
+    long write_to(int fd, zerocopy_sender* zerocopy = nullptr, long* syscalls = nullptr);
+
+    void clear();
+
+private:
+    friend class zerocopy_sender;
+
+    /*
+        数据块的段头放在块的开头，追加和移动段都不需要另外分配内存。
+        引用外部内存和文件的段头单独分配。
+    */
+    struct segment{
+        segment* next;
+        char* data;
+        int begin;
+        int end;
+        int capacity;
+        int block_size;//为0时是外部内存或文件
+        std::function<void()> release;
+        int file_fd;//不为-1时是文件段，data不使用
+        off_t file_offset;
+        long file_length;
+        //以MSG_ZEROCOPY发出过时，最后一次发送的序号，完成之前不能释放
+        zerocopy_sender* zerocopy;
+        uint32_t zerocopy_seq;
+    };
+
+    void mark_zerocopy(long size, zerocopy_sender* zerocopy, uint32_t seq);
+
+    long send_file_segment(int fd, long& syscalls);
+
+    static void release_segment(segment* s);
+
+    void push_segment(segment* s);
+
+    segment* head;
+    segment* tail;
+    long readable_size;
+};
+
+class zerocopy_sender{
+/*
+    一个套接字上MSG_ZEROCOPY发送的状态，由tcp_connection持有。
+    每次MSG_ZEROCOPY发送占用一个序号，内核在套接字的错误队列中按序号区间通知完成，
+    event_loop在EPOLLERR时调用reap取出通知。发出的段在对应的发送完成之前留在这里，
+    之后才把数据块还给buffer_pool、或调用外部内存的release。
+*/
+public:
+    zerocopy_sender();
+
+    zerocopy_sender(const zerocopy_sender&) = delete;
+
+    ~zerocopy_sender();
+
+    //在套接字上开启SO_ZEROCOPY，threshold为0时关闭。失败时返回-1，保持关闭
+    int enable(int fd, long threshold);
+
+    bool is_enabled();
+
+    long get_threshold();
+
+    //读取错误队列中的全部完成通知，错误队列中有其他错误时返回-1
+    int reap(int fd);
+
+    //等待完成通知的段数
+    size_t get_held_count();
+
+    //还有MSG_ZEROCOPY发送没有收到完成通知，内核仍可能读取这些段的内存
+    bool has_outstanding();
+
+    //不再等待完成通知，持有的和之后交来的未完成段都不释放、直接丢弃。只在确实等不到通知时使用
+    void abandon();
+
+    //所有连接中MSG_ZEROCOPY发送的次数、收到的完成通知覆盖的发送次数、以及其中内核退回复制的次数
+    static long get_sends();
+
+    static long get_completions();
+
+    static long get_copied();
+
+private:
+    friend class chain_buffer;
+
+    uint32_t next_send_seq();
+
+    bool is_completed(uint32_t seq);
+
+    void complete(uint32_t lo, uint32_t hi);
+
+    void hold(chain_buffer::segment* s);
+
+    void release_completed();
+
+    long threshold;
+    uint32_t next_seq;
+    uint32_t completed_seq;//该序号之前的发送都已完成
+    std::vector<std::pair<uint32_t, uint32_t>> early_ranges;//不连续、先到的完成区间
+    chain_buffer::segment* held_head;
+    chain_buffer::segment* held_tail;
+    size_t held_count;
+    bool abandoned;
+
+    static std::atomic<long> sends;
+    static std::atomic<long> completions;
+    static std::atomic<long> copied;
+};
+
+
+#endif
@@ -4,7 +4,16 @@ void make_noblocking(int fd){
     fcntl(fd, F_SETFL, O_NONBLOCK);
 }
 
+static bool log_enabled = true;
+
+void set_log_enabled(bool enabled){
+    //压测时关闭逐事件的调试输出，错误输出不受影响
+    log_enabled = enabled;
+}
+
 void log_msg(/*const char* lc,*/ const char* fmt, ...){
+    if(!log_enabled)
+        return;
     va_list ps;
     va_start(ps, fmt);
     vprintf(fmt, ps);
@@ -27,4 +36,35 @@ const char* get_extension(const char* file_name){
             return file_name + i;
     }
     return nullptr;
-}
\ No newline at end of file
+}
+
+int get_cpu_node(int cpu){
+    //cpu的sysfs目录下有一个指向所在节点的nodeN链接
+    for(int node{}; node != 64; ++node){
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+        if(access(path, F_OK) == 0)
+            return node;
+    }
+    return -1;
+}
+
+int set_preferred_node(int node){
+    if(node < 0 || node >= 63)
+        return -1;
+    unsigned long mask = 1UL << node;
+    return syscall(__NR_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8);
+}
+
+int bind_memory_node(void* addr, size_t size, int node){
+    if(node < 0 || node >= 63)
+        return -1;
+    //mbind只接受按页对齐的范围，两端不完整的页面留在原处
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = (reinterpret_cast<uintptr_t>(addr) + page - 1) & ~(page - 1);
+    uintptr_t end = (reinterpret_cast<uintptr_t>(addr) + size) & ~(page - 1);
+    if(begin >= end)
+        return 0;
+    unsigned long mask = 1UL << node;
+    return syscall(__NR_mbind, begin, end - begin, MPOL_PREFERRED, &mask, sizeof(mask) * 8, MPOL_MF_MOVE);
+}
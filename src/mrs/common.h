@@ -3,21 +3,35 @@
 
 #include<stdexcept>
 #include<map>
+#include<atomic>
+#include<functional>
+#include<memory>
+#include<vector>
+#include<algorithm>
 
 #include<cstdlib>//exit()
 #include<cassert>//assert()
 #include<cstdio>//sprintf()
 #include<cstdarg>//va_list
 #include<cstring>//memcpy()
+#include<cerrno>//errno
+#include<ctime>//clock_gettime()
 #include<type_traits>
 
 #include<pthread.h>
-#include<sys/socket.h>//socketpair()
+#include<sys/socket.h>//socket()
+#include<sys/eventfd.h>//eventfd()
+#include<sys/timerfd.h>//timerfd_create()
 #include<unistd.h>//read()
 #include<netinet/in.h>//sockaddr_in
 #include<fcntl.h>//fcntl()
 #include<sys/epoll.h>//epoll()
 #include<sys/stat.h>//stat()
+#include<sys/uio.h>//readv()
+#include<sys/syscall.h>//syscall()
+#include<csignal>//_NSIG
+#include<sched.h>//sched_getcpu()
+#include<linux/mempolicy.h>//MPOL_PREFERRED
 
 template<typename DEST_TYPE, typename SOURCE_TYPE>
 DEST_TYPE pointer_cast(SOURCE_TYPE source_type){
@@ -34,10 +48,21 @@ auto const_pointer_cast(SOURCE_TYPE source_type){
 
 void make_noblocking(int fd);
 
+void set_log_enabled(bool enabled);
+
 void log_msg(/*const char* lc,*/ const char* fmt, ...);
 
 void log_err(const char* fmt, ...);
 
 const char* get_extension(const char* file_name);
 
+//cpu所在的NUMA节点，无法确定时返回-1
+int get_cpu_node(int cpu);
+
+//当前线程此后首次访问的页面优先从node分配
+int set_preferred_node(int node);
+
+//把[addr, addr + size)中完整的页面迁移并绑定到node，不支持时返回-1
+int bind_memory_node(void* addr, size_t size, int node);
+
 #endif
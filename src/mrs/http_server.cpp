@@ -3,20 +3,117 @@
 //http_request
 
 static const int INIT_REQUEST_HEADER_SIZE = 128;
-static const char* HTTP10 = "HTTP/1.0";
-static const char* HTTP11 = "HTTP/1.1";
-static const char* KEEP_ALIVE = "Keep-Alive";
-static const char* CLOSE = "close";
+static const std::string_view KEEP_ALIVE = "keep-alive";
+static const std::string_view CLOSE = "close";
+static const std::string_view CHUNKED = "chunked";
+static const std::string_view CONTINUE = "100-continue";
+
+static inline char ascii_lower(char c){
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+//请求头的名称和Connection的取值不区分大小写，只涉及ASCII，不受locale影响
+static bool equals_ignore_case(std::string_view a, std::string_view b){
+    if(a.size() != b.size())
+        return false;
+    //大小写通常与规范写法一致
+    if(memcmp(a.data(), b.data(), a.size()) == 0)
+        return true;
+    for(size_t i{}; i != a.size(); ++i)
+        if(ascii_lower(a[i]) != ascii_lower(b[i]))
+            return false;
+    return true;
+}
+
+//Content-Length只能是十进制数字，不接受符号和空白，溢出时失败
+static bool parse_content_length(std::string_view value, size_t* length){
+    if(value.empty() || value.size() > 18)
+        return false;
+    size_t n{};
+    for(char c : value){
+        if(c < '0' || c > '9')
+            return false;
+        n = n * 10 + (c - '0');
+    }
+    *length = n;
+    return true;
+}
+
+//按http_header_id的顺序，小写
+static const std::string_view KNOWN_HEADER_NAMES[header_unknown] = {
+    "host",
+    "connection",
+    "content-length",
+    "content-type",
+    "transfer-encoding",
+    "accept",
+    "accept-encoding",
+    "accept-language",
+    "if-none-match",
+    "if-modified-since",
+    "range",
+    "user-agent",
+    "cookie",
+    "expect",
+    "upgrade",
+    "authorization",
+};
+
+//按长度和首尾字符散列，常用请求头之间没有冲突
+static const int HEADER_CLASS_SIZE = 32;
+
+static inline unsigned header_class_slot(std::string_view key){
+    return (key.size() * 6 + uint8_t(key.front() | 0x20) * 19 + uint8_t(key.back() | 0x20)) % HEADER_CLASS_SIZE;
+}
+
+static const struct header_class_table{
+    int8_t ids[HEADER_CLASS_SIZE];
+
+    header_class_table(){
+        memset(ids, -1, sizeof(ids));
+        for(int i{}; i != header_unknown; ++i){
+            unsigned slot = header_class_slot(KNOWN_HEADER_NAMES[i]);
+            assert(ids[slot] == -1);
+            ids[slot] = i;
+        }
+    }
+} HEADER_CLASSES;
+
+//只取长度和首、中、尾三个字符，不区分大小写。请求头不多，冲突由线性探测解决
+static uint32_t hash_header_name(std::string_view key){
+    if(key.empty())
+        return 0;
+    uint32_t h = uint32_t(key.size()) << 24 |
+        uint32_t(uint8_t(ascii_lower(key[0]))) << 16 |
+        uint32_t(uint8_t(ascii_lower(key[key.size() / 2]))) << 8 |
+        uint8_t(ascii_lower(key.back()));
+    return (h * 2654435769u) >> 24;
+}
 
 http_request::http_request() :
-    version(nullptr),
-    method(nullptr),
-    url(nullptr),
-    path(nullptr),
+    data(nullptr),
+    length{},
+    storage(nullptr),
+    minor_version{},
+    method{},
+    url{},
+    path{},
     current_state(0),
+    scanned_length{},
+    framing(body_none),
+    body_remaining{},
+    body_received{},
+    max_body_size(HTTP_MAX_BODY_SIZE),
+    chunked_decoder{},
     request_headers(new request_header[INIT_REQUEST_HEADER_SIZE]),
-    request_headers_number(0)
-{}
+    request_headers_number(0),
+    known_headers{},
+    header_hash{},
+    header_hash_built{}
+{
+    static_assert(INIT_REQUEST_HEADER_SIZE < 256 && HTTP_HEADER_HASH_SIZE >= 2 * INIT_REQUEST_HEADER_SIZE,
+        "header indexes are stored in uint8_t");
+}
 
 http_request::~http_request(){
     clear_free_space();
@@ -28,17 +125,71 @@ http_request::~http_request(){
 
 void http_request::reset(){
     clear_free_space();
+    data = nullptr;
+    length = 0;
+    method = url = path = std::string_view();
     current_state = 0;
+    scanned_length = 0;
+    framing = body_none;
+    body_remaining = 0;
+    body_received = 0;
+    max_body_size = HTTP_MAX_BODY_SIZE;
+    chunked_decoder = phr_chunked_decoder{};
     request_headers_number = 0;
+    memset(known_headers, 0, sizeof(known_headers));
+    if(header_hash_built){
+        memset(header_hash, 0, sizeof(header_hash));
+        header_hash_built = false;
+    }
 }
 
-const char* http_request::get_header(const char* key){
-    if(request_headers){
-        for(int i{}; i != request_headers_number; ++i)
-            if(strncmp(request_headers[i].key, key, strlen(key)) == 0)
-                return request_headers[i].value;
+std::string_view http_request::get_header(http_header_id id){
+    if(id < 0 || id >= header_unknown || !known_headers[id])
+        return std::string_view();
+    return request_headers[known_headers[id] - 1].value;
+}
+
+std::string_view http_request::get_header(std::string_view key){
+    http_header_id id = classify_header(key);
+    if(id != header_unknown)
+        return get_header(id);
+
+    if(!header_hash_built)
+        build_header_hash();
+    for(uint32_t slot = hash_header_name(key);; ++slot){
+        int index = header_hash[slot % HTTP_HEADER_HASH_SIZE];
+        if(!index)
+            return std::string_view();
+        if(equals_ignore_case(request_headers[index - 1].key, key))
+            return request_headers[index - 1].value;
     }
-    return nullptr;
+}
+
+http_header_id http_request::classify_header(std::string_view key){
+    //每个请求头都要归类一次，查表得到唯一的候选，再逐字符确认
+    if(key.empty())
+        return header_unknown;
+    int id = HEADER_CLASSES.ids[header_class_slot(key)];
+    if(id < 0 || KNOWN_HEADER_NAMES[id].size() != key.size())
+        return header_unknown;
+
+    /*
+        常用请求头的名称只有小写字母和'-'，picohttpparser保证名称中都是token字符，
+        其中按位或0x20之后落在这个范围内的只有大写字母，可以一次比较8个字符。
+    */
+    std::string_view name = KNOWN_HEADER_NAMES[id];
+    size_t i{};
+    for(; i + 8 <= name.size(); i += 8){
+        uint64_t a, b;
+        memcpy(&a, key.data() + i, 8);
+        memcpy(&b, name.data() + i, 8);
+        if((a | 0x2020202020202020ull) != b)
+            return header_unknown;
+    }
+    for(; i != name.size(); ++i)
+        if((key[i] | 0x20) != name[i])
+            return header_unknown;
+    return http_header_id(id);
 }
 
 int http_request::is_parsed(){
@@ -46,169 +197,288 @@ int http_request::is_parsed(){
 }
 
 int http_request::close_connection(){
-    const char* connection = get_header("Connection");
+    std::string_view connection = get_header(header_connection);
 
-    if(connection && strncmp(connection, CLOSE, strlen(CLOSE)) == 0)
+    if(equals_ignore_case(connection, CLOSE))
         return 1;
 
-    if(version && strncmp(version, HTTP10, strlen(HTTP10)) == 0 &&
-        strncmp(connection, KEEP_ALIVE, strlen(KEEP_ALIVE)) == 1){
-            return 1;
-        }
+    //HTTP/1.0默认不保持连接
+    if(minor_version == 0 && !equals_ignore_case(connection, KEEP_ALIVE))
+        return 1;
     return 0;
 }
 
-int http_request::parse_http_request(buffer* input){
+int http_request::parse_http_request(buffer* input, size_t max_header_size){
 
     const char *parsed_method, *parsed_path;
-    int pret, minor_version;
+    int pret, parsed_minor_version;
     struct phr_header headers[INIT_REQUEST_HEADER_SIZE];
-    size_t buflen = input->get_readable_size() + 1;
-    size_t pbuflen = 0, method_len, path_len, num_headers = INIT_REQUEST_HEADER_SIZE;
+    //不能把结尾的0算进去，否则不完整的请求头会被当作格式错误
+    size_t buflen = input->get_readable_size();
+    size_t method_len, path_len, num_headers = INIT_REQUEST_HEADER_SIZE;
 
-    //printf("prase----VVVV\n");
-    //printf("%s<<\n", input->get_readable_data());
+    //scanned_length不为0时，picohttpparser只从上次的结尾附近查找空行，请求头不完整时不再从头解析
     pret = phr_parse_request(input->get_readable_data(), buflen, &parsed_method, &method_len, &parsed_path, 
-                            &path_len, &minor_version, headers, &num_headers, pbuflen);
+                            &path_len, &parsed_minor_version, headers, &num_headers, scanned_length);
 
     if(pret <= 0){
         if(pret == -1){
             //printf("parser error\n");
+            scanned_length = 0;
             return 0;
         }
         assert(pret == -2);
-        if(buflen == sizeof(buffer)){
-            //printf("request is too long error\n");
-            return -1;
+        if(buflen >= max_header_size){
+            scanned_length = 0;
+            return -2;
         }
+        //请求不完整，记下已经检查过的长度
+        scanned_length = buflen;
+        return -1;
     }
-    // printf("method: %.*s\n", (int)method_len, parsed_method);
-    // printf("path: %.*s\n", (int)path_len, parsed_path);
-    // printf("HTTP version: 1.%d\n", minor_version);
-    // printf("headers: %d\n", num_headers);
+
+    scanned_length = 0;
+    if(size_t(pret) > max_header_size)
+        return -2;
 
     current_state = 1;
 
     clear_free_space();
-    
-    //version
-    version = new char[9];
-    strncpy(version, "HTTP/1.1", 9);
-    version[7] = minor_version + '0';
-
-    //method
-    method = new char[method_len + 1];
-    strncpy(method, parsed_method, method_len);
-    method[method_len] = '\0';
-
-    //url
-    url = new char[path_len + 1];
-    strncpy(url, parsed_path, path_len);
-    url[path_len] = '\0';
-
-    //headers
+
+    data = input->get_readable_data();
+    length = pret;
+    minor_version = parsed_minor_version;
+    method = std::string_view(parsed_method, method_len);
+    url = std::string_view(parsed_path, path_len);
+    path = url.substr(0, url.find('?'));
+
     request_headers_number = num_headers;
-    for(int i = 0; i != num_headers; ++i){
-        //key
-        auto key_size = headers[i].name_len;
-        char* key = new char[ key_size + 1];
-        strncpy(key, headers[i].name, key_size);
-        key[key_size] = '\0';
-        request_headers[i].key = key;
-
-        //value
-        auto value_size = headers[i].value_len;
-        char* value = new char[value_size + 1];
-        strncpy(value, headers[i].value, value_size);
-        value[value_size] = '\0';
-        request_headers[i].value = value;
+    memset(known_headers, 0, sizeof(known_headers));
+    if(header_hash_built){
+        memset(header_hash, 0, sizeof(header_hash));
+        header_hash_built = false;
+    }
+    for(size_t i = 0; i != num_headers; ++i){
+        request_headers[i].key = std::string_view(headers[i].name, headers[i].name_len);
+        request_headers[i].value = std::string_view(headers[i].value, headers[i].value_len);
+
+        http_header_id id = classify_header(request_headers[i].key);
+        if(id == header_unknown)
+            continue;
+        if(!known_headers[id])
+            known_headers[id] = i + 1;
+        //重复的Content-Length或Transfer-Encoding取值不同时无法确定请求体的边界，按400处理
+        else if((id == header_content_length || id == header_transfer_encoding) &&
+            request_headers[known_headers[id] - 1].value != request_headers[i].value)
+            return 0;
+    }
+    return parse_body_framing() ? 1 : 0;
+}
+
+bool http_request::has_body(){
+    return framing != body_none;
+}
+
+bool http_request::expects_continue(){
+    return has_body() && equals_ignore_case(get_header(header_expect), CONTINUE);
+}
+
+void http_request::set_max_body_size(size_t size){
+    max_body_size = size;
+}
+
+size_t http_request::get_body_received(){
+    return body_received;
+}
+
+int http_request::read_body(buffer* input, std::string_view* fragment){
+    *fragment = std::string_view();
+    char* p = input->get_readable_data();
+    size_t size = input->get_readable_size();
+
+    if(framing == body_length){
+        //Content-Length在第一段到达之前就能判断是否超过上限
+        if(body_received + body_remaining > max_body_size)
+            return -3;
+        size_t n = std::min(size, body_remaining);
+        *fragment = std::string_view(p, n);
+        input->consume(n);
+        body_received += n;
+        body_remaining -= n;
+        return body_remaining ? -1 : 1;
+    }
+
+    if(framing == body_chunked){
+        //解码后的数据移到p的开头，结束时请求体之后的数据紧跟在解码数据之后
+        size_t decoded = size;
+        ssize_t left = phr_decode_chunked(&chunked_decoder, p, &decoded);
+        if(left == -1)
+            return 0;
+        if(body_received + decoded > max_body_size)
+            return -3;
+        *fragment = std::string_view(p, decoded);
+        body_received += decoded;
+        if(left == -2){
+            input->consume(size);
+            return -1;
+        }
+        //把之后的请求移回数据区末尾，解码数据不受影响
+        memmove(p + size - left, p + decoded, left);
+        input->consume(size - left);
+        return 1;
     }
-    
     return 1;
 }
 
-char* http_request::get_url(){
-    return url;
+int http_request::get_length(){
+    return length;
 }
 
-char* http_request::get_path(){
-    if(path)
-        return path;
-    
-    char* query = pointer_cast<char*>(memmem(url, strlen(url), "?", 1));
-    int path_length = query ? query - url : strlen(url);
+std::string_view http_request::get_method(){
+    return method;
+}
 
-    path = new char[path_length + 1];
-    strncpy(path, url, path_length);
-    path[path_length] = '\0';
+std::string_view http_request::get_url(){
+    return url;
+}
 
+std::string_view http_request::get_path(){
     return path;
 }
-//private
-void http_request::clear_free_space(){
-    if(version){
-        delete[] version;
-        version = nullptr;
+
+void http_request::own_data(){
+    if(!data || storage)
+        return;
+    storage = new char[length];
+    memcpy(storage, data, length);
+
+    //视图都落在[data, data + length)之内，平移到storage上
+    auto rebase = [this](std::string_view& view){
+        if(view.data())
+            view = std::string_view(storage + (view.data() - data), view.size());
+    };
+    rebase(method);
+    rebase(url);
+    rebase(path);
+    for(int i{}; i != request_headers_number; ++i){
+        rebase(request_headers[i].key);
+        rebase(request_headers[i].value);
     }
-    if(method){
-        delete[] method;
-        method = nullptr;
+    data = storage;
+}
+
+void http_request::swap(http_request& other){
+    std::swap(data, other.data);
+    std::swap(length, other.length);
+    std::swap(storage, other.storage);
+    std::swap(minor_version, other.minor_version);
+    std::swap(method, other.method);
+    std::swap(url, other.url);
+    std::swap(path, other.path);
+    std::swap(current_state, other.current_state);
+    std::swap(scanned_length, other.scanned_length);
+    std::swap(framing, other.framing);
+    std::swap(body_remaining, other.body_remaining);
+    std::swap(body_received, other.body_received);
+    std::swap(max_body_size, other.max_body_size);
+    std::swap(chunked_decoder, other.chunked_decoder);
+    std::swap(request_headers, other.request_headers);
+    std::swap(request_headers_number, other.request_headers_number);
+    std::swap(known_headers, other.known_headers);
+    std::swap(header_hash, other.header_hash);
+    std::swap(header_hash_built, other.header_hash_built);
+}
+
+//private
+bool http_request::parse_body_framing(){
+    framing = body_none;
+    body_remaining = 0;
+    body_received = 0;
+    chunked_decoder = phr_chunked_decoder{};
+    //分块编码的结尾可能有trailer，一并读掉
+    chunked_decoder.consume_trailer = 1;
+
+    std::string_view encoding = get_header(header_transfer_encoding);
+    std::string_view content_length = get_header(header_content_length);
+    if(!encoding.empty()){
+        //只支持chunked；同时带Content-Length的请求可能被用来夹带请求，一律拒绝
+        if(!equals_ignore_case(encoding, CHUNKED) || !content_length.empty())
+            return false;
+        framing = body_chunked;
+        return true;
     }
-    if(url){
-        delete[] url;
-        url = nullptr;
+    if(!content_length.empty()){
+        if(!parse_content_length(content_length, &body_remaining))
+            return false;
+        if(body_remaining)
+            framing = body_length;
     }
-    if(path){
-        delete[] path;
-        path = nullptr;
+    return true;
+}
+
+void http_request::build_header_hash(){
+    //只收录常用请求头之外的，按出现顺序插入，同名时先找到第一个
+    for(int i{}; i != request_headers_number; ++i){
+        std::string_view key = request_headers[i].key;
+        if(classify_header(key) != header_unknown)
+            continue;
+        uint32_t slot = hash_header_name(key);
+        while(header_hash[slot % HTTP_HEADER_HASH_SIZE])
+            ++slot;
+        header_hash[slot % HTTP_HEADER_HASH_SIZE] = i + 1;
     }
-    
-    for(int i = 0; i < request_headers_number; ++i){
-        delete[] request_headers[i].key;
-        delete[] request_headers[i].value;
+    header_hash_built = true;
+}
+
+void http_request::clear_free_space(){
+    if(storage){
+        delete[] storage;
+        storage = nullptr;
     }
 }
 
 
 //http-response
 
-static const int INIT_RESPONSE_HEADER_SIZE = 128;
-
 http_response::http_response() :
     status(unknown),
     status_message(nullptr),
     content_type(nullptr),
     body{},
-    response_headers(new response_header[INIT_RESPONSE_HEADER_SIZE]),
+    response_headers{},
     response_headers_number(0),
-    keep_connected(0)
+    keep_connected(0),
+    streaming{}
 {}
 
 http_response::~http_response(){
-    delete[] response_headers;
 }
 
-void http_response::encode_buffer(buffer* output){
+void http_response::encode_buffer(chain_buffer* output){
     char buf[32];
     snprintf(buf, sizeof(buf), "HTTP/1.1 %d ", status);
     output->append_string(buf);
     output->append_string(status_message);
     output->append_string("\r\n");
     //printf("[encoding] %s", output->get_readable_data());
-    if(keep_connected)
-        output->append_string("Connection: close\r\n");
+    //关闭连接时也要带上消息长度，客户端据此判断响应是否完整
+    if(streaming)
+        output->append_string("Transfer-Encoding: chunked\r\n");
     else{
-        snprintf(buf, sizeof(buf), "Content-Length: %zd\r\n", body.get_readable_size());
+        snprintf(buf, sizeof(buf), "Content-Length: %ld\r\n", body.get_readable_size());
         output->append_string(buf);
-        
-        output->append_string("Content-Type: ");
-        output->append_string(content_type);
-        output->append_string("\r\n");
+    }
+
+    output->append_string("Content-Type: ");
+    output->append_string(content_type);
+    output->append_string("\r\n");
 
+    if(keep_connected)
+        output->append_string("Connection: close\r\n");
+    else
         output->append_string("Connection: Keep-alive\r\n");
-    }
 
-    if(response_headers && response_headers_number > 0){
+    if(response_headers_number > 0){
         for(int i{}; i!=response_headers_number; ++i){
             output->append_string(response_headers[i].key);
             output->append_string(": ");
@@ -218,11 +488,133 @@ void http_response::encode_buffer(buffer* output){
     }
 
     output->append_string("\r\n");
-    output->append(body.get_readable_data(), body.get_readable_size());
+    if(streaming && !body.empty()){
+        snprintf(buf, sizeof(buf), "%lx\r\n", body.get_readable_size());
+        output->append_string(buf);
+        output->append_chain(body);
+        output->append_string("\r\n");
+    }
+    else
+        output->append_chain(body);
     
 }
 
-int http_response::request(http_request* a_http_request){
+bool http_response::is_streaming(){
+    return streaming;
+}
+
+void http_response::stream_body(){
+    streaming = true;
+}
+
+int http_response::stream(std::shared_ptr<http_stream> a_stream){
+    return a_stream->finish();
+}
+
+int http_response::request(http_request* /*a_http_request*/){
     return 0;
 }
 
+int http_response::request_body(http_request* /*a_http_request*/, std::string_view /*data*/){
+    return 0;
+}
+
+int http_response::request_completed(http_request* /*a_http_request*/){
+    return 0;
+}
+
+
+//http-stream
+
+http_stream::http_stream(tcp_connection* a_connection, event_loop* a_event_loop) :
+    connection(a_connection),
+    p_event_loop(a_event_loop),
+    finished{},
+    writable_callback{},
+    finished_callback{}
+{}
+
+int http_stream::write(const void* data, size_t size){
+    if(!size)
+        return is_closed() || finished ? -1 : 0;
+    chain_buffer chunk;
+    //append的长度是int，超过INT_MAX的数据分段追加
+    const char* from = static_cast<const char*>(data);
+    for(size_t left = size; left;){
+        int n = int(std::min<size_t>(left, INT_MAX));
+        chunk.append(from, n);
+        from += n;
+        left -= n;
+    }
+    return send_chunk(&chunk, size);
+}
+
+int http_stream::write(chain_buffer* chain){
+    size_t size = chain->get_readable_size();
+    if(!size)
+        return is_closed() || finished ? -1 : 0;
+    chain_buffer chunk;
+    chunk.append_chain(*chain);
+    return send_chunk(&chunk, size);
+}
+
+int http_stream::finish(){
+    if(is_closed() || finished)
+        return -1;
+    finished = true;
+    //回调中通常持有本对象，结束时断开
+    writable_callback = nullptr;
+    const char* last_chunk = "0\r\n\r\n";
+    connection->send_data(last_chunk, strlen(last_chunk));
+    if(finished_callback){
+        auto callback = std::move(finished_callback);
+        finished_callback = nullptr;
+        callback();
+    }
+    return 0;
+}
+
+bool http_stream::is_writable(){
+    return !is_closed() && !finished && !connection->is_output_full();
+}
+
+bool http_stream::is_finished(){
+    return finished;
+}
+
+bool http_stream::is_closed(){
+    //连接关闭到释放之间fd可能已被复用，也按已关闭处理
+    return !connection || connection->is_closed();
+}
+
+event_loop* http_stream::get_event_loop(){
+    return p_event_loop;
+}
+
+void http_stream::on_writable(std::function<void()> callback){
+    if(is_closed() || finished)
+        return;
+    if(!connection->is_output_full()){
+        callback();
+        return;
+    }
+    writable_callback = std::move(callback);
+    connection->wait_output_drained();
+}
+
+//private
+int http_stream::send_chunk(chain_buffer* chunk, size_t size){
+    if(is_closed() || finished){
+        chunk->clear();
+        return -1;
+    }
+    //分块的长度行和结尾的CRLF与数据一起发出
+    char size_line[32];
+    snprintf(size_line, sizeof(size_line), "%zx\r\n", size);
+    chain_buffer output;
+    output.append_string(size_line);
+    output.append_chain(*chunk);
+    output.append_string("\r\n");
+    connection->send_chain(&output);
+    return 0;
+}
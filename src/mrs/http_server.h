@@ -5,45 +5,154 @@
 #include"tcp_server.h"
 #include"picohttpparser.h"
 
+#include<string_view>
+
 //http-request
 
+//解析时归类的常用请求头，按编号直接取值
+enum http_header_id{
+    header_host,
+    header_connection,
+    header_content_length,
+    header_content_type,
+    header_transfer_encoding,
+    header_accept,
+    header_accept_encoding,
+    header_accept_language,
+    header_if_none_match,
+    header_if_modified_since,
+    header_range,
+    header_user_agent,
+    header_cookie,
+    header_expect,
+    header_upgrade,
+    header_authorization,
+    header_unknown,
+};
+
+//请求行加请求头的默认上限，超过时按431 Request Header Fields Too Large处理
+const size_t HTTP_MAX_HEADER_SIZE = 65536;
+
+//请求体的默认上限，超过时按413 Payload Too Large处理
+const size_t HTTP_MAX_BODY_SIZE = 1 << 20;
+
+//其余请求头在第一次按名称查找时建立的散列表大小，是请求头数上限的2倍
+const int HTTP_HEADER_HASH_SIZE = 256;
+
 class http_request{
+/*
+    解析出的方法、URL和请求头都是指向连接input_buffer的视图，解析时不分配内存，也不复制。
+    连接在响应生成之后才consume请求头，在此之前视图一直有效；交给工作线程的请求
+    先调用own_data复制一份。
+*/
 public:
     http_request();
 
+    http_request(const http_request&) = delete;
+
     ~http_request();
 
     void reset();
 
-    const char* get_header(const char* key);
+    //没有该请求头时返回空的视图，data()为nullptr。同名的请求头取第一个
+    std::string_view get_header(http_header_id id);
+
+    //名称不区分大小写，常用请求头按编号取值，其余的查散列表
+    std::string_view get_header(std::string_view key);
+
+    //名称对应的编号，不是常用请求头时返回header_unknown
+    static http_header_id classify_header(std::string_view key);
 
     int is_parsed();
 
     int close_connection();
 
-    int parse_http_request(buffer* input);
+    /*
+        成功时返回1，请求头的数据仍留在input中，处理完后consume get_length()字节。
+        格式错误返回0，不完整返回-1，超过max_header_size返回-2。
+        不完整时记住已经检查过的长度，下次调用时从那里继续，逐段到达的请求头总的解析代价是线性的；
+        两次调用之间input中未consume的数据不能改变。
+    */
+    int parse_http_request(buffer* input, size_t max_header_size = HTTP_MAX_HEADER_SIZE);
+
+    //请求头的字节数
+    int get_length();
 
-    char* get_url();
+    //带有Content-Length（不为0）或Transfer-Encoding: chunked
+    bool has_body();
 
-    char* get_path();
+    //带有Expect: 100-continue，客户端等到100 Continue才发送请求体
+    bool expects_continue();
+
+    //请求体的字节数上限，可以在响应的request()中按路径调整
+    void set_max_body_size(size_t size);
+
+    //已经读出的请求体字节数，分块编码时是解码之后的
+    size_t get_body_received();
+
+    /*
+        请求头consume之后，从input中读出下一段请求体并consume，分块编码在input中原地解码。
+        请求体结束返回1，需要更多数据返回-1，两种情况下fragment中都可能有数据；
+        格式错误返回0，超过上限返回-3。fragment指向input的数据区，下次向input写入前有效。
+    */
+    int read_body(buffer* input, std::string_view* fragment);
+
+    std::string_view get_method();
+
+    std::string_view get_url();
+
+    //URL中?之前的部分
+    std::string_view get_path();
+
+    //把请求头复制到自己的内存中，之后不再依赖input_buffer
+    void own_data();
+
+    //交换两个请求的全部内容，用于把解析好的请求交给工作线程
+    void swap(http_request& other);
 
 private:
     void clear_free_space();
 
-    char* version;
-    char* method;
-    char* url;
-    char* path;
+    void build_header_hash();
+
+    //根据Transfer-Encoding和Content-Length确定请求体的长度，不合法时返回false。重复的请求头在建立索引时已经检查
+    bool parse_body_framing();
+
+    const char* data;//请求头的起始位置，own_data之后指向storage
+    int length;
+    char* storage;
+    int minor_version;
+    std::string_view method;
+    std::string_view url;
+    std::string_view path;
     int current_state;
+    //上次解析不完整时input中的字节数，作为picohttpparser的last_len
+    size_t scanned_length;
+    enum body_framing{
+        body_none,
+        body_length,
+        body_chunked,
+    } framing;
+    size_t body_remaining;//Content-Length中还没有读出的字节数
+    size_t body_received;
+    size_t max_body_size;
+    phr_chunked_decoder chunked_decoder;
     struct request_header{
-        char* key;
-        char* value;
+        std::string_view key;
+        std::string_view value;
     }* request_headers;
     int request_headers_number;
+    //request_headers中的下标加1，0表示没有。只存下标，own_data和swap时不需要调整
+    uint8_t known_headers[header_unknown];
+    uint8_t header_hash[HTTP_HEADER_HASH_SIZE];
+    bool header_hash_built;
 };
 
 //http-response
 
+//响应头数组放在http_response内部，构造响应时不分配内存
+const int INIT_RESPONSE_HEADER_SIZE = 128;
+
 struct response_header{
     char* key;
     char* value;
@@ -57,72 +166,515 @@ enum http_statuscode{
     not_found = 404,
 };
 
+template<typename RESPONSE>
+class http_connection;
+
+class http_stream{
+/*
+    流式响应的发送端，由连接创建后交给http_response::stream()。每次write作为一个分块
+    追加到连接的发送缓冲，finish发送结束块。生产者在is_writable返回false时暂停，
+    用on_writable等发送缓冲降到低水位以下再继续，占用的内存不超过连接的高水位。
+    只能在连接的event_loop线程中使用，其他线程产生的数据用get_event_loop()->run_in_loop
+    转交；连接关闭后写入返回-1。
+*/
+public:
+    http_stream(tcp_connection* a_connection, event_loop* a_event_loop);
+
+    http_stream(const http_stream&) = delete;
+
+    //空数据不发送，已经finish或连接已关闭时返回-1
+    int write(const void* data, size_t size);
+
+    //chain中的数据块不复制地移入发送缓冲，chain变为空
+    int write(chain_buffer* chain);
+
+    //发送结束块，之后连接继续处理后面的请求
+    int finish();
+
+    bool is_writable();
+
+    bool is_finished();
+
+    bool is_closed();
+
+    //连接所在的event_loop，生产者可以在上面设置定时器或投递任务
+    event_loop* get_event_loop();
+
+    //发送缓冲降到低水位以下时调用一次callback，当前已经可写时直接调用
+    void on_writable(std::function<void()> callback);
+
+private:
+    template<typename RESPONSE>
+    friend class http_connection;
+
+    int send_chunk(chain_buffer* chunk, size_t size);
+
+    tcp_connection* connection;//连接关闭时由连接置空
+    event_loop* p_event_loop;
+    bool finished;
+    std::function<void()> writable_callback;
+    std::function<void()> finished_callback;
+};
+
 class http_response{
 public:
     http_response();
 
     ~http_response();
 
-    void encode_buffer(buffer* output);
+    //响应头复制到output中，body的数据块不复制地移到其后；流式响应的body作为第一个分块
+    void encode_buffer(chain_buffer* output);
+
+    bool is_streaming();
+
+    /*
+        响应头发出后在连接的event_loop线程中调用，流式响应从这里开始写入，默认直接结束。
+        响应对象在stream()返回后释放，之后生产者需要的状态由它的回调自己持有。
+    */
+    virtual int stream(std::shared_ptr<http_stream> a_stream);
 
+    //请求头解析完成后调用，请求体还没有读出
     virtual int request(http_request* a_http_request);
 
+    //请求体按到达的顺序逐段交给响应，data在返回后失效。默认丢弃
+    virtual int request_body(http_request* a_http_request, std::string_view data);
+
+    //请求体全部读出后调用，没有请求体时紧接在request()之后，之后编码响应
+    virtual int request_completed(http_request* a_http_request);
+
 protected:
+    //在request()或request_completed()中调用，响应体以Transfer-Encoding: chunked在stream()中分块发送
+    void stream_body();
+
     http_statuscode status;
     const char* status_message;
     const char* content_type;
-    buffer body;
-    response_header* response_headers;
+    chain_buffer body;
+    response_header response_headers[INIT_RESPONSE_HEADER_SIZE];
     int response_headers_number;
     int keep_connected;
+    bool streaming;
 };
 
+/*
+    RESPONSE中定义static const bool run_in_worker = true时，request()和响应的编码
+    交给event_loop的工作线程池执行，适合耗时的业务逻辑。
+*/
+template<typename RESPONSE, typename = void>
+struct response_runs_in_worker : std::false_type{};
+
+template<typename RESPONSE>
+struct response_runs_in_worker<RESPONSE, typename std::enable_if<RESPONSE::run_in_worker>::type> : std::true_type{};
+
+//连接空闲（没有进行中的请求）超过该时间则关闭
+const int64_t HTTP_IDLE_TIMEOUT_MS = 60000;
+//请求头开始到达后，超过该时间仍未接收完整则关闭
+const int64_t HTTP_HEADER_TIMEOUT_MS = 10000;
+
 template<typename RESPONSE>
 class http_connection : public tcp_connection{
 public:
     http_connection(int connect_fd, event_loop* a_event_loop) :
         tcp_connection(connect_fd, a_event_loop),
-        m_http_request{}
+        m_http_request{},
+        idle_timer{},
+        header_timer{},
+        closing{},
+        body_response{},
+        body_work{},
+        continue_expected{},
+        active_stream{},
+        in_message{}
     {}
 
+    int connection_opened() override{
+        start_idle_timer();
+        return 0;
+    }
+
     int message(buffer* buf)override {
+        //流式响应在本次处理中结束时，由这里的循环继续处理后面的请求
+        in_message = true;
+        int result = handle_message(buf);
+        in_message = false;
+        return result;
+    }
+
+    ~http_connection(){
+        //之后生产者的写入都会失败
+        if(active_stream){
+            active_stream->connection = nullptr;
+            active_stream->writable_callback = nullptr;
+        }
+        //log_msg("[http connection] destructed\n");
+    }
+    
+    int write_completed(){
+        //
+        return 0;
+    }
+
+    int output_drained() override{
+        if(active_stream && active_stream->writable_callback){
+            auto callback = std::move(active_stream->writable_callback);
+            active_stream->writable_callback = nullptr;
+            callback();
+        }
+        return 0;
+    }
+
+    //单位毫秒，为0时不启用。需要在服务器启动前设置
+    static void set_timeouts(int64_t idle_ms, int64_t header_ms){
+        idle_timeout_ms = idle_ms;
+        header_timeout_ms = header_ms;
+    }
+
+    //请求行加请求头的字节数上限，超过时回复431并关闭连接。需要在服务器启动前设置
+    static void set_max_header_size(size_t size){
+        max_header_size = size;
+    }
+
+    /*
+        请求体的默认上限，超过时回复413并关闭连接。需要在服务器启动前设置。
+        响应可以在request()中调用http_request::set_max_body_size按路径调整；
+        交给工作线程的请求在请求体读完后才调用request()，只受这里的上限约束。
+    */
+    static void set_max_body_size(size_t size){
+        max_body_size = size;
+    }
+
+private:
+    //请求和编码好的响应由任务持有，连接先关闭时随任务一起释放
+    struct work_state{
+        http_request request;
+        //request()在工作线程中执行，请求体先在这里收集完整
+        std::string body;
+        //流式响应在连接的线程中继续使用
+        std::unique_ptr<RESPONSE> response;
+        chain_buffer output;
+        int close{};
+    };
+
+    int handle_message(buffer* buf){
+        /*
+            流水线：一次处理input_buffer中全部完整的请求，每个请求只consume自己的字节。
+            本轮同步生成的响应按顺序收集在一个chain_buffer中，最后以一次聚集写发出；
+            交给工作线程的请求由run_in_worker保证顺序。
+            带请求体的请求先复制请求头并consume，请求体读到多少就交给响应多少，
+            可以跨越多次读取，读完之后再编码响应。
+            流式响应发送期间不处理后面的请求，也暂停读取，之后的请求留在内核中，结束后再继续。
+        */
         //log_msg("[http connection] get message from tcp connection %s\n", name);
-        if(m_http_request.parse_http_request(buf) == 0){
-            const char* error_response = "HTTP/1.1 400 Bad Request\r\n\r\n";
-            send_data(error_response, sizeof(error_response));
-            shutdown_connection();
+        stop_timer(idle_timer);
+        if(active_stream)
+            return 0;
+
+        //Connection: close之后的请求不再处理，但它自己的请求体要读完
+        if(closing && !receiving_body()){
+            buf->consume(buf->get_readable_size());
+            return 0;
         }
 
-        if(m_http_request.is_parsed() == 1){
-            RESPONSE response;
+        chain_buffer responses;
+        int parsed = -1;
+        while((!closing || receiving_body()) && !active_stream){
+            if(receiving_body()){
+                if((parsed = receive_body(buf, &responses)) != 1)
+                    break;
+                continue;
+            }
+            if((parsed = m_http_request.parse_http_request(buf, max_header_size)) != 1)
+                break;
+            stop_timer(header_timer);
+            closing = m_http_request.close_connection();
+            m_http_request.set_max_body_size(max_body_size);
+
+            if(response_runs_in_worker<RESPONSE>::value && p_event_loop->get_worker_pool())
+                respond_in_worker();
+            else if(m_http_request.has_body()){
+                start_body(buf);
+                //请求体读完之前请求还要使用
+                continue;
+            }
+            else{
+                RESPONSE response;
 
-            response.request(&m_http_request);
+                response.request(&m_http_request);
+                response.request_completed(&m_http_request);
+                response.encode_buffer(&responses);
+                //响应已经生成，请求头不再被引用
+                buf->consume(m_http_request.get_length());
+                if(response.is_streaming())
+                    start_stream(&response, &responses);
+            }
+
+            m_http_request.reset();
+        }
 
-            buffer t_buffer;
-            
-            response.encode_buffer(&t_buffer);
-            //log_msg("[response] encode\n%.*s\n", 500 /*t_buffer.get_readable_size()*/, t_buffer.get_readable_data());
-            t_buffer.send(this);
+        if(!responses.empty())
+            send_chain(&responses);
 
-            if(m_http_request.close_connection())
+        if(parsed == 0 || parsed == -2 || parsed == -3){
+            buf->consume(buf->get_readable_size());
+            closing = true;
+            //前面的请求还在工作线程中时，错误响应也要排在它们的响应之后
+            run_in_order([this, parsed]{
+                const char* response = error_response(parsed);
+                send_data(response, strlen(response));
                 shutdown_connection();
+            });
+            return 0;
+        }
 
-            m_http_request.reset();
+        //流式响应由生产者控制节奏，结束时再决定关闭或计时
+        if(active_stream)
+            return 0;
+
+        if(receiving_body()){
+            //请求体中途停止发送时，按空闲超时关闭
+            start_idle_timer();
+            return 0;
         }
+
+        if(closing){
+            buf->consume(buf->get_readable_size());
+            //交给工作线程的请求在完成时关闭
+            if(!has_worker_jobs())
+                shutdown_connection();
+            return 0;
+        }
+
+        if(buf->get_readable_size() > 0){
+            //请求头不完整，从第一次收到时开始计时，之后的分段不重新计时
+            if(!header_timer && header_timeout_ms > 0)
+                header_timer = run_after(header_timeout_ms, [this]{
+                    log_msg("[http connection] %s request header timeout\n", name);
+                    header_timer = 0;
+                    force_close();
+                });
+            return 0;
+        }
+
+        //还有请求在工作线程中时不算空闲，最后一个完成后再开始计时
+        if(!has_worker_jobs())
+            start_idle_timer();
         return 0;
     }
 
-    ~http_connection(){
-        //
-        //log_msg("[http connection] destructed\n");
+    bool receiving_body(){
+        return body_response || body_work;
     }
-    
-    int write_completed(){
-        //
-        return 0;
+
+    void start_body(buffer* buf){
+        //请求体跨越多次读取时input_buffer会被覆盖，请求头先复制出来
+        m_http_request.own_data();
+        buf->consume(m_http_request.get_length());
+        body_response.reset(new RESPONSE);
+        body_response->request(&m_http_request);
+        continue_expected = m_http_request.expects_continue();
     }
-private:
+
+    //请求体读完返回1，否则返回read_body的结果
+    int receive_body(buffer* buf, chain_buffer* responses){
+        http_request* request = body_work ? &body_work->request : &m_http_request;
+        std::string_view fragment;
+        int state = request->read_body(buf, &fragment);
+        if(state == 0 || state == -3){
+            body_response.reset();
+            body_work.reset();
+            m_http_request.reset();
+            return state;
+        }
+
+        if(!fragment.empty()){
+            if(body_work)
+                body_work->body.append(fragment.data(), fragment.size());
+            else
+                body_response->request_body(request, fragment);
+        }
+
+        if(state == -1){
+            //上限已经检查过，通知客户端开始发送请求体
+            if(continue_expected){
+                const char* continue_response = "HTTP/1.1 100 Continue\r\n\r\n";
+                if(body_work)
+                    run_in_order([this, continue_response]{
+                        send_data(continue_response, strlen(continue_response));
+                    });
+                else
+                    responses->append_string(continue_response);
+            }
+            continue_expected = false;
+            return -1;
+        }
+
+        continue_expected = false;
+        if(body_work)
+            run_work(std::move(body_work));
+        else{
+            body_response->request_completed(&m_http_request);
+            body_response->encode_buffer(responses);
+            if(body_response->is_streaming())
+                start_stream(body_response.get(), responses);
+            body_response.reset();
+            m_http_request.reset();
+        }
+        return 1;
+    }
+
+    void respond_in_worker(){
+        auto state = std::make_shared<work_state>();
+        state->request.swap(m_http_request);
+        //之后的读取会覆盖input_buffer
+        state->request.own_data();
+        input_buffer->consume(state->request.get_length());
+
+        if(state->request.has_body()){
+            continue_expected = state->request.expects_continue();
+            body_work = std::move(state);
+            return;
+        }
+        run_work(std::move(state));
+    }
+
+    void run_work(std::shared_ptr<work_state> state){
+        run_in_worker([state]{
+            state->response.reset(new RESPONSE);
+            RESPONSE& response = *state->response;
+            response.request(&state->request);
+            if(!state->body.empty())
+                response.request_body(&state->request, state->body);
+            response.request_completed(&state->request);
+            response.encode_buffer(&state->output);
+            state->close = state->request.close_connection();
+            //不是流式响应时在工作线程中释放
+            if(!response.is_streaming())
+                state->response.reset();
+        }, [this, state]{
+            deliver_work(state);
+        });
+    }
+
+    void deliver_work(std::shared_ptr<work_state> state){
+        //流式响应发送期间完成的，等它结束后按顺序发出
+        if(active_stream){
+            after_stream.push_back([this, state]{ deliver_work(state); });
+            return;
+        }
+        if(state->response){
+            start_stream(state->response.get(), &state->output);
+            if(active_stream)
+                return;
+        }
+        else
+            send_chain(&state->output);
+        if(state->close)
+            shutdown_connection();
+        if(!has_worker_jobs() && !receiving_body())
+            start_idle_timer();
+    }
+
+    //把响应头和之前的响应发出，再交给响应的stream()
+    void start_stream(RESPONSE* response, chain_buffer* responses){
+        send_chain(responses);
+        auto stream = std::make_shared<http_stream>(this, p_event_loop);
+        stream->finished_callback = [this]{ stream_finished(); };
+        active_stream = stream;
+        //发送期间不处理后面的请求，不读取以免input_buffer无限增长
+        pause_reading();
+        response->stream(stream);
+    }
+
+    void stream_finished(){
+        active_stream.reset();
+        resume_reading();
+        //在handle_message中结束的，由它的循环继续
+        if(in_message)
+            return;
+
+        while(!after_stream.empty() && !active_stream){
+            auto callback = std::move(after_stream.front());
+            after_stream.pop_front();
+            callback();
+        }
+        if(active_stream)
+            return;
+
+        if(closing && !receiving_body()){
+            if(!has_worker_jobs())
+                shutdown_connection();
+            return;
+        }
+        //处理流式响应期间到达的请求，没有时开始空闲计时
+        message(input_buffer);
+    }
+
+    void run_in_order(std::function<void()> callback){
+        if(active_stream)
+            after_stream.push_back(std::move(callback));
+        else if(has_worker_jobs())
+            run_in_worker([]{}, std::move(callback));
+        else
+            callback();
+    }
+
+    static const char* error_response(int parsed){
+        //发送后即关闭连接，声明空的响应体，客户端不必等到连接关闭才确定响应结束
+        if(parsed == -2)
+            return "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        if(parsed == -3)
+            return "HTTP/1.1 413 Payload Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        return "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    }
+
+    void start_idle_timer(){
+        if(idle_timeout_ms <= 0)
+            return;
+        stop_timer(idle_timer);
+        idle_timer = run_after(idle_timeout_ms, [this]{
+            log_msg("[http connection] %s idle timeout\n", name);
+            idle_timer = 0;
+            force_close();
+        });
+    }
+
+    void stop_timer(timer_id& id){
+        if(id){
+            cancel(id);
+            id = 0;
+        }
+    }
+
     http_request m_http_request;
+    timer_id idle_timer;
+    timer_id header_timer;
+    //收到Connection: close或格式错误的请求后，不再处理之后的数据
+    bool closing;
+    //正在读取请求体的请求：同步处理的响应已经收到request()，交给工作线程的在收集请求体
+    std::unique_ptr<RESPONSE> body_response;
+    std::shared_ptr<work_state> body_work;
+    bool continue_expected;
+    //正在发送的流式响应，以及在它之后才能发出的回调
+    std::shared_ptr<http_stream> active_stream;
+    std::deque<std::function<void()>> after_stream;
+    bool in_message;
+
+    static int64_t idle_timeout_ms;
+    static int64_t header_timeout_ms;
+    static size_t max_header_size;
+    static size_t max_body_size;
 };
 
+template<typename RESPONSE>
+int64_t http_connection<RESPONSE>::idle_timeout_ms = HTTP_IDLE_TIMEOUT_MS;
+
+template<typename RESPONSE>
+int64_t http_connection<RESPONSE>::header_timeout_ms = HTTP_HEADER_TIMEOUT_MS;
+
+template<typename RESPONSE>
+size_t http_connection<RESPONSE>::max_header_size = HTTP_MAX_HEADER_SIZE;
+
+template<typename RESPONSE>
+size_t http_connection<RESPONSE>::max_body_size = HTTP_MAX_BODY_SIZE;
+
 #endif
@@ -0,0 +1,126 @@
+#ifndef LOOP_TASK_H
+#define LOOP_TASK_H
+
+#include"common.h"
+
+#include<cstddef>//std::max_align_t
+#include<new>//placement new
+
+//不超过该大小、且移动时不抛异常的可调用对象直接存放在loop_task内部
+const size_t LOOP_TASK_INLINE_SIZE = 48;
+
+class loop_task{
+/*
+    投递到event_loop的任务，只能移动的void()可调用对象。
+    与std::function不同，捕获不多的lambda直接构造在内部的缓冲区中，投递时不分配内存，
+    较大的可调用对象才放到堆上。
+*/
+public:
+    loop_task() :
+        m_ops(nullptr)
+    {}
+
+    template<typename F, typename = typename std::enable_if<
+                !std::is_same<typename std::decay<F>::type, loop_task>::value>::type>
+    loop_task(F&& f) :
+        m_ops(nullptr)
+    {
+        typedef typename std::decay<F>::type callable;
+        if(fits_inline<callable>()){
+            new(storage) callable(std::forward<F>(f));
+            m_ops = inline_ops<callable>();
+        }
+        else{
+            *reinterpret_cast<callable**>(storage) = new callable(std::forward<F>(f));
+            m_ops = heap_ops<callable>();
+        }
+    }
+
+    loop_task(loop_task&& other) noexcept :
+        m_ops(other.m_ops)
+    {
+        if(m_ops){
+            m_ops->move(storage, other.storage);
+            other.m_ops = nullptr;
+        }
+    }
+
+    loop_task& operator=(loop_task&& other) noexcept{
+        if(this != &other){
+            reset();
+            m_ops = other.m_ops;
+            if(m_ops){
+                m_ops->move(storage, other.storage);
+                other.m_ops = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    loop_task(const loop_task&) = delete;
+
+    loop_task& operator=(const loop_task&) = delete;
+
+    ~loop_task(){
+        reset();
+    }
+
+    void operator()(){
+        m_ops->invoke(storage);
+    }
+
+    explicit operator bool() const{
+        return m_ops != nullptr;
+    }
+
+    void reset(){
+        if(m_ops){
+            m_ops->destroy(storage);
+            m_ops = nullptr;
+        }
+    }
+
+private:
+    struct task_ops{
+        void (*invoke)(void* storage);
+        //从src移动构造到dst，并析构src
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void* storage);
+    };
+
+    template<typename callable>
+    static constexpr bool fits_inline(){
+        return sizeof(callable) <= LOOP_TASK_INLINE_SIZE &&
+                alignof(callable) <= alignof(std::max_align_t) &&
+                std::is_nothrow_move_constructible<callable>::value;
+    }
+
+    template<typename callable>
+    static const task_ops* inline_ops(){
+        static const task_ops ops{
+            [](void* s){ (*static_cast<callable*>(s))(); },
+            [](void* dst, void* src){
+                callable* from = static_cast<callable*>(src);
+                new(dst) callable(std::move(*from));
+                from->~callable();
+            },
+            [](void* s){ static_cast<callable*>(s)->~callable(); },
+        };
+        return &ops;
+    }
+
+    template<typename callable>
+    static const task_ops* heap_ops(){
+        static const task_ops ops{
+            [](void* s){ (**static_cast<callable**>(s))(); },
+            [](void* dst, void* src){ *static_cast<callable**>(dst) = *static_cast<callable**>(src); },
+            [](void* s){ delete *static_cast<callable**>(s); },
+        };
+        return &ops;
+    }
+
+    alignas(std::max_align_t) unsigned char storage[LOOP_TASK_INLINE_SIZE];
+    const task_ops* m_ops;
+};
+
+#endif
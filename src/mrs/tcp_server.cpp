@@ -1,8 +1,10 @@
 #include"tcp_server.h"
+#include"uring_dispatcher.h"
 
 //channel
 channel::channel(int a_fd, int a_events, event_loop* a_event_loop):
-    fd(a_fd), events(a_events), p_event_loop(a_event_loop)
+    fd(a_fd), events(a_events), p_event_loop(a_event_loop), closed{},
+    pending_next(nullptr), pending_ops{}
 {}
 
 channel::~channel() {}
@@ -15,6 +17,21 @@ int channel::write() {
     return 0;
 }
 
+int channel::error() {
+    return -1;
+}
+
+int channel::flush() {
+    return 0;
+}
+
+int channel::registered() {
+    return 0;
+}
+
+void channel::closing() {
+}
+
 void channel::set_write_event_enable(bool enable){
     if(enable)
         events |= EVENT_WRITE;
@@ -28,6 +45,19 @@ bool channel::get_write_event() {
     return events & EVENT_WRITE;
 }
 
+void channel::set_read_event_enable(bool enable){
+    if(enable)
+        events |= EVENT_READ;
+    else
+        events &= (~EVENT_READ);
+    
+    p_event_loop->update_channel_event(fd, this);
+}
+
+bool channel::get_read_event() {
+    return events & EVENT_READ;
+}
+
 int channel::get_fd() {
     return fd;
 }
@@ -40,6 +70,10 @@ event_loop* channel::get_event_loop() {
     return p_event_loop;
 }
 
+bool channel::is_closed() {
+    return closed;
+}
+
 //wakeup_channel
 wakeup_channel::wakeup_channel(int a_fd, int a_events, event_loop* a_event_loop) :
     channel(a_fd, a_events, a_event_loop)
@@ -48,16 +82,32 @@ wakeup_channel::wakeup_channel(int a_fd, int a_events, event_loop* a_event_loop)
     }
 
 int wakeup_channel::read() {
-    //读取一个字符，作用是让子线程从dispatch的阻塞中苏醒。
+    /*
+        作用是让子线程从dispatch的阻塞中苏醒。先清除唤醒标记再读取eventfd，
+        一次read即可清空计数，清除之后到来的唤醒会重新写入并再次触发。
+    */
     log_msg("[wakeup channel] wakeup\n");
-    char c;
-    ssize_t n = ::read(get_event_loop()->get_second_socket_fd(), &c, sizeof(c));
-    if(n != sizeof(c))
+    get_event_loop()->clear_wakeup();
+    uint64_t n;
+    if(::read(get_fd(), &n, sizeof(n)) != sizeof(n) && errno != EAGAIN)
         log_err("handle wakeup failed");
     //msg "wakeup" p_event_loop->get_name();
     return 0;
 }
 
+//timer_channel
+timer_channel::timer_channel(int a_fd, int a_events, event_loop* a_event_loop) :
+    channel(a_fd, a_events, a_event_loop)
+{}
+
+int timer_channel::read() {
+    uint64_t expirations;
+    if(::read(get_fd(), &expirations, sizeof(expirations)) != sizeof(expirations) && errno != EAGAIN)
+        log_err("handle timer failed");
+    //按单调时钟推进，不依赖expirations，错过的tick会一并补上
+    get_event_loop()->handle_timers();
+    return 0;
+}
 
 //connection_channel
 connection_channel::connection_channel(int a_fd, int a_events, event_loop* a_event_loop, tcp_connection* a_tcp_connection) :
@@ -68,23 +118,74 @@ connection_channel::connection_channel(int a_fd, int a_events, event_loop* a_eve
 
 connection_channel::~connection_channel() {
     log_msg("connect_channel destruction\n");
+    p_tcp_connection->connection_closed();
     delete p_tcp_connection;
 }
 
 int connection_channel::read() {
-    buffer buf;
-    int p = buf.socket_read(get_fd());
+    buffer* input = p_tcp_connection->input_buffer;
+    event_loop* loop = get_event_loop();
 
-    if(!p)
-        return 1;
+    for(int i{}; i != READ_BUDGET; ++i){
+        //输出积压超过高水位，等发送到低水位以下再读
+        if(p_tcp_connection->reading_paused || p_tcp_connection->reading_held || p_tcp_connection->input_closed)
+            break;
+
+        int p = input->socket_read(get_fd());
+        loop->add_socket_reads(1);
+        if(p < 0){
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return 1;
+        }
+        if(!p){
+            if(p_tcp_connection->handle_eof())
+                return 1;
+            break;
+        }
+
+        log_msg("[connect channel] read %d bytes, %d bytes buffered\n", p, input->get_readable_size());
+        //处理期间读到的字节计入待处理字节数，其他线程分配连接时可以看到这个loop正忙
+        loop->add_pending_bytes(p);
+        p_tcp_connection->message(input);
+        loop->add_pending_bytes(-p);
+        //message中连接被关闭
+        if(is_closed())
+            return 0;
 
-    log_msg("[connect channel] read %d bytes\n", p );
-    //log_msg("[connect channel] read %d bytes\n%s\n", p, buf.get_readable_data());
-    p_tcp_connection->message(&buf);
-    //log_msg("[connect channel] readend\n");
+        if(i + 1 == READ_BUDGET || input->get_readable_size() >= INPUT_HIGH_WATERMARK){
+            //预算用尽或积压过多时还没有读到EAGAIN，边沿触发下不会再收到通知
+            loop->queue_read(this);
+            break;
+        }
+    }
+    p_tcp_connection->update_pending_bytes();
+    p_tcp_connection->release_idle_buffers();
     return 0;
 }
 
+int connection_channel::write() {
+    return p_tcp_connection->handle_write();
+}
+
+int connection_channel::error() {
+    return p_tcp_connection->handle_error();
+}
+
+int connection_channel::flush() {
+    return p_tcp_connection->handle_flush();
+}
+
+int connection_channel::registered() {
+    return p_tcp_connection->connection_opened();
+}
+
+void connection_channel::closing() {
+    p_tcp_connection->handle_closing();
+}
+
 //listen_channel
 listen_channel::listen_channel(int a_fd, int a_events, event_loop* a_event_loop, TCPserver_base* a_TCPserver) :
     channel(a_fd, a_events, a_event_loop),
@@ -95,69 +196,186 @@ listen_channel::listen_channel(int a_fd, int a_events, event_loop* a_event_loop,
 
 int listen_channel::read() {
     log_msg("[listen channel] read\n");
-    return p_TCPserver->handle_connection_established();
+    if(p_TCPserver->handle_connection_established(get_fd(), get_event_loop()))
+        get_event_loop()->queue_read(this);
+    return 0;
 }
 
 
 //channel_map
-channel_map::channel_map() : m_map{} {
-    /*
-        暂时使用map实现
-    */
-}
+static const int INIT_CHANNEL_MAP_SIZE = 1024;
 
-channel_map::~channel_map() {}
+channel_map::channel_map() :
+    m_channels(INIT_CHANNEL_MAP_SIZE, nullptr),
+    m_size{},
+    closed_channels{}
+{}
 
-int channel_map::activate(int fd, int events) {
-    // log_msg("[channel map] activate fd = %d\n", fd);
-    if(!m_map.count(fd))
-        return 0;
-    
-    channel* cc = m_map[fd];
-    assert(fd == cc->get_fd());
+channel_map::~channel_map() {
+    release_closed();
+}
+
+int channel_map::activate(channel* cc, int events) {
+    assert(cc == (*this)[cc->get_fd()]);
 
     if(events & EVENT_READ) {
-        if(cc->read()) {//返回值不为0则出错
-            close(fd);
-            log_msg("[channel map] fd == %d, closed\n", fd);
-            //m_map[fd] = nullptr;
-            remove(fd);
-            delete cc;
-            log_msg("[channel map] now sockets = %d\n", m_map.size());
-            return 0;
-        }
+        if(cc->read())//返回值不为0则出错，由调用者经dispatcher关闭
+            return -1;
+    }
+    //读的过程中可能已经关闭
+    if((events & EVENT_WRITE) && !cc->is_closed()) {
+        if(cc->write())
+            return -1;
     }
-    if(events & EVENT_WRITE)
-        cc->write();
     return 0;
 }
 
 int channel_map::insert(int fd, channel* cc) {
     //log_msg("[channel map] insert channel fd = %d\n", cc->get_fd());
-    if(m_map.count(fd) && m_map[fd])
+    if(fd < 0)
         return 0;
-    m_map[fd] = cc;
+    if(fd >= static_cast<int>(m_channels.size())){
+        size_t new_size = m_channels.size() * 2;
+        while(static_cast<int>(new_size) <= fd)
+            new_size *= 2;
+        m_channels.resize(new_size, nullptr);
+    }
+    if(m_channels[fd])
+        return 0;
+    m_channels[fd] = cc;
+    ++m_size;
     return 0;
 }
 
 channel* channel_map::operator[](int fd) {
-    if(!m_map.count(fd))
+    if(fd < 0 || fd >= static_cast<int>(m_channels.size()))
         return nullptr;
-    return m_map[fd];
+    return m_channels[fd];
 }
 
 bool channel_map::contains(int fd) {
-    return m_map.count(fd);
+    return (*this)[fd] != nullptr;
 }
 
 void channel_map::remove(int fd) {
-    m_map.erase(fd);
+    if(!contains(fd))
+        return;
+    m_channels[fd] = nullptr;
+    --m_size;
+}
+
+void channel_map::close_channel(channel* cc) {
+    if(cc->closed)
+        return;
+    int fd = cc->get_fd();
+    if((*this)[fd] == cc)
+        remove(fd);
+    cc->closing();
+    close(fd);
+    log_msg("[channel map] fd == %d, closed\n", fd);
+    cc->closed = true;
+    closed_channels.push_back(cc);
+    log_msg("[channel map] now sockets = %d\n", m_size);
+}
+
+void channel_map::release_closed() {
+    //释放过程中（如连接的析构）可能再关闭其他channel
+    while(!closed_channels.empty()){
+        std::vector<channel*> t;
+        t.swap(closed_channels);
+        for(auto cc : t)
+            delete cc;
+    }
+}
+
+int channel_map::size() {
+    return m_size;
+}
+
+std::vector<channel*> channel_map::get_channels() {
+    std::vector<channel*> channels;
+    channels.reserve(m_size);
+    for(auto cc : m_channels)
+        if(cc)
+            channels.push_back(cc);
+    return channels;
 }
 
 //event_dispatcher
-event_dispatcher::event_dispatcher(channel_map* a_channel_map) :
+std::atomic<long> event_dispatcher::syscalls{};
+
+event_dispatcher::event_dispatcher(channel_map* a_channel_map, const event_loop_options& options) :
     p_channel_map(a_channel_map),
-    event_count{},
+    event_count(std::max(options.max_events, 1)),
+    event_limit(std::max(options.max_events_limit, event_count))
+{}
+
+event_dispatcher::~event_dispatcher() {}
+
+void event_dispatcher::close_channel(channel* cc) {
+    p_channel_map->close_channel(cc);
+}
+
+int event_dispatcher::get_event_count() {
+    return event_count;
+}
+
+long event_dispatcher::get_syscalls() {
+    return syscalls.load(std::memory_order_relaxed);
+}
+
+event_dispatcher* event_dispatcher::create(channel_map* a_channel_map, const event_loop_options& options) {
+    if(options.backend == backend_uring_poll) {
+        try {
+            return new uring_dispatcher(a_channel_map, options);
+        }
+        catch(const std::runtime_error& e) {
+            log_err("[event dispatcher] %s, fall back to epoll\n", e.what());
+        }
+    }
+    return new epoll_dispatcher(a_channel_map, options);
+}
+
+void event_dispatcher::handle_event(channel* cc, uint32_t events) {
+    //本轮中已被前面的事件或定时器关闭
+    if(cc->is_closed())
+        return;
+
+    //错误队列中有MSG_ZEROCOPY的完成通知时也会报告EPOLLERR。连接本身出错（重置、超时）时
+    //同时带有EPOLLHUP，下面照样关闭，或由之后的读写返回错误
+    if((events & EPOLLERR) && cc->error() == 0)
+        events &= ~EPOLLERR;
+
+    if((events & EPOLLERR) || ((events & EPOLLHUP) && !(events & EPOLLIN))) {
+        //对端重置连接等也会走到这里，不属于服务器错误
+        log_msg("[event dispatcher] fd == %d, epoll error\n", cc->get_fd());
+        close_channel(cc);
+        return;
+    }
+
+    int active{};
+    if(events & (EPOLLIN | EPOLLHUP))
+        active |= EVENT_READ;
+    if(events & EPOLLOUT)
+        active |= EVENT_WRITE;
+
+    //log_msg("[event dispathcer] get message channel fd = %d\n", cc->get_fd());
+    if(p_channel_map->activate(cc, active))
+        close_channel(cc);
+}
+
+bool event_dispatcher::grow_events(int n) {
+    //一次就取满说明还有事件没取出来，连接很多时用更大的数组减少dispatch的次数
+    if(n < event_count || event_count >= event_limit)
+        return false;
+    event_count = std::min(event_count * 2, event_limit);
+    log_msg("[event dispatcher] grow events to %d\n", event_count);
+    return true;
+}
+
+//epoll_dispatcher
+epoll_dispatcher::epoll_dispatcher(channel_map* a_channel_map, const event_loop_options& options) :
+    event_dispatcher(a_channel_map, options),
     nfds{},
     realloc_copy{}
 {
@@ -165,55 +383,43 @@ event_dispatcher::event_dispatcher(channel_map* a_channel_map) :
     if(efd == -1)
         throw std::runtime_error("epoll create failed");
     
-    m_events = new epoll_event[MAX_EVENTS];
+    m_events = new epoll_event[event_count];
 }
 
-event_dispatcher::~event_dispatcher() {
+epoll_dispatcher::~epoll_dispatcher() {
     delete[] m_events;
     close(efd);
 }
 
-int event_dispatcher::add(channel* cc) {
+int epoll_dispatcher::add(channel* cc) {
     return do_modify(cc, EPOLL_CTL_ADD);
 }
 
-int event_dispatcher::remove(channel* cc) {
+int epoll_dispatcher::remove(channel* cc) {
     return do_modify(cc, EPOLL_CTL_DEL);
 }
 
-int event_dispatcher::update(channel* cc) {
+int epoll_dispatcher::update(channel* cc) {
     return do_modify(cc, EPOLL_CTL_MOD);
 }
 
-int event_dispatcher::dispatch() {
+int epoll_dispatcher::dispatch(int timeout_ms) {
     //log_msg("count: %d\n", p_channel_map->size());
-    int n = epoll_wait(efd, m_events, MAX_EVENTS, -1);
+    int n = epoll_wait(efd, m_events, event_count, timeout_ms);
+    syscalls.fetch_add(1, std::memory_order_relaxed);
     //msg epoll_wait wakeup thread_name
 
-    decltype(epoll_event::events) events;
-    for(int i{}; i < n; ++i) {
-        events = m_events[i].events;
-
-        if((events & EPOLLERR) || (events & EPOLLHUP)) {
-            log_err("epoll error\n");
-            close(m_events[i].data.fd);
-            continue;
-        }
-
-        if(events & EPOLLIN) {
-            //log_msg("[event dispathcer] get message channel fd = %d\n", m_events[i].data.fd);
-            p_channel_map->activate(m_events[i].data.fd, EVENT_READ);
-        }
-
-        if(events & EPOLLOUT) {
-            p_channel_map->activate(m_events[i].data.fd, EVENT_WRITE);
-        }
+    for(int i{}; i < n; ++i)
+        handle_event(static_cast<channel*>(m_events[i].data.ptr), m_events[i].events);
 
+    if(grow_events(n)) {
+        delete[] m_events;
+        m_events = new epoll_event[event_count];
     }
-    return 0;
+    return std::max(n, 0);
 }
 
-int event_dispatcher::do_modify(channel* cc, uint32_t type) {
+int epoll_dispatcher::do_modify(channel* cc, uint32_t type) {
     int fd = cc->get_fd();
     int events{};
 
@@ -223,9 +429,10 @@ int event_dispatcher::do_modify(channel* cc, uint32_t type) {
         events |= (EPOLLOUT | EPOLLET);
     
     epoll_event event;
-    event.data.fd = fd;
+    event.data.ptr = cc;
     event.events = events;
 
+    syscalls.fetch_add(1, std::memory_order_relaxed);
     if(epoll_ctl(efd, type, fd, &event) == -1) {
         switch(type) {
         case EPOLL_CTL_ADD:{
@@ -248,9 +455,13 @@ int event_dispatcher::do_modify(channel* cc, uint32_t type) {
     return 0;
 }
 
+const char* epoll_dispatcher::get_name() {
+    return "epoll";
+}
+
 
 //acceptor
-acceptor::acceptor(int port) :
+acceptor::acceptor(int port, bool reuse_port) :
     listen_port(port)
 {
     listen_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -262,6 +473,8 @@ acceptor::acceptor(int port) :
 
     int on = 1;
     setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if(reuse_port && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+        throw std::runtime_error("set SO_REUSEPORT failed");
 
     if(bind(listen_fd, pointer_cast<sockaddr*>(&server_addr), sizeof(server_addr)) == -1)
         throw std::runtime_error("bind failed");
@@ -279,50 +492,93 @@ int acceptor::get_port(){
     return listen_port;
 }
 
-//channel_element
-channel_element::channel_element(channel* a_channel, int a_type, channel_element* a_next) :
-    p_channel(a_channel),
-    m_type(a_type),
-    p_next(a_next)
+//pending_channel_queue
+pending_channel_queue::pending_channel_queue() :
+    head(nullptr)
 {}
 
-channel_element::~channel_element(){
-
-}
-
-channel* channel_element::get_channel(){
-    return p_channel;
-}
+void pending_channel_queue::push(channel* cc, int ops){
+    if(cc->pending_ops.fetch_or(ops, std::memory_order_acq_rel) != 0)
+        return;
 
-int channel_element::type(){
-    return m_type;
+    channel* old_head = head.load(std::memory_order_relaxed);
+    do{
+        cc->pending_next = old_head;
+    }while(!head.compare_exchange_weak(old_head, cc,
+                std::memory_order_seq_cst, std::memory_order_relaxed));
+}
+
+channel* pending_channel_queue::pop_all(){
+    //与event_loop::wakeup_pending的读写保持全序，清除唤醒标记之前入队的channel一定能被取到
+    channel* p = head.exchange(nullptr, std::memory_order_seq_cst);
+    //入队是压栈，反转后才是入队顺序
+    channel* ordered = nullptr;
+    while(p){
+        channel* next = p->pending_next;
+        p->pending_next = ordered;
+        ordered = p;
+        p = next;
+    }
+    return ordered;
 }
 
-channel_element* channel_element::next(){
-    return p_next;
+int pending_channel_queue::take(channel* cc, channel*& next){
+    //先取next再清空pending_ops，清空之后生产者可能立即把该channel重新入队
+    next = cc->pending_next;
+    return cc->pending_ops.exchange(0, std::memory_order_acq_rel);
 }
 
-void channel_element::set_next(channel_element* a_next){
-    p_next = a_next;
+bool pending_channel_queue::empty(){
+    return head.load(std::memory_order_acquire) == nullptr;
 }
 
 
 //event_loop
-event_loop::event_loop(const char* a_thread_name) : 
+event_loop::event_loop(const char* a_thread_name, const event_loop_options& a_options) : 
     thread_name(a_thread_name),
+    options(a_options),
     quit{},
     map{},
-    dispatcher(&map),
-    socket_pair{},
-    is_handle_pending{},
-    pending_front(nullptr),
-    pending_back(nullptr),
-    owner_thread_id(pthread_self()),
-    mutex{},
-    cond{}
+    dispatcher(event_dispatcher::create(&map, options)),
+    wakeup_fd(-1),
+    wakeup_pending{},
+    wakeup_writes{},
+    pending{},
+    timers{},
+    timer_fd(-1),
+    timer_deadline_ms(-1),
+    ready_channels{},
+    handling_channels{},
+    flush_channels{},
+    zerocopy_orphans{},
+    zerocopy_timer{},
+    dispatches{},
+    wakeups{},
+    dispatched_events{},
+    busy_poll_hits{},
+    busy_poll_misses{},
+    busy_poll_ns{},
+    worker_completions{},
+    tasks_run{},
+    task_batches{},
+    last_task_batch{},
+    max_task_batch{},
+    socket_reads{},
+    socket_writes{},
+    socket_accepts{},
+    deferred_flushes{},
+    task_mutex{},
+    queued_tasks{},
+    running_tasks{},
+    queued_task_count{},
+    p_worker_pool{},
+    completions{},
+    connections{},
+    pending_bytes{},
+    cpu(-1),
+    numa_node(-1),
+    owner_thread_id(pthread_self())
 {
-    pthread_mutex_init(&mutex, NULL);
-    pthread_cond_init(&cond, NULL);
     /*
         从reactor线程是一个无限循环的event_loop执行体，在没有已注册事件发生
         的情况下，该线程阻塞在event_dispatcher的dispatch函数上。这种情况下如
@@ -330,20 +586,42 @@ event_loop::event_loop(const char* a_thread_name) :
 
         可以令从reactor线程从dispatch函数上返回，再让从reactor线程返回后注册
         新的已连接套接字事件即可。
-        构建一个类似管道的描述字，令event_dispatcher注册该描述字，当想让从
-        reactor线程苏醒时，向管道上发送一个字符即可。
-        socketpair函数创建的套接字对，其作用就是在一侧写时，另一侧就可以感知
-        到读的事件。这里也可以直接使用UNIX的pipe管道。
+        令event_dispatcher注册一个eventfd，当想让从reactor线程苏醒时，向其写入
+        计数即可。配合wakeup_pending标记，一批连续的唤醒只需要一次write。
     */
-    if(socketpair(AF_UNIX, SOCK_STREAM, 0, socket_pair) == -1)
-        log_err("socketpair set failed");
+    pthread_mutex_init(&task_mutex, nullptr);
 
-    channel *cc = new wakeup_channel(socket_pair[1], EVENT_READ, this);
-    add_channel_event(socket_pair[1], cc);
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(wakeup_fd == -1)
+        throw std::runtime_error("eventfd create failed");
+
+    channel *cc = new wakeup_channel(wakeup_fd, EVENT_READ, this);
+    add_channel_event(wakeup_fd, cc);
+
+    //时间轮中有定时器时timerfd按tick周期触发，没有时停止
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(timer_fd == -1)
+        throw std::runtime_error("timerfd create failed");
+
+    cc = new timer_channel(timer_fd, EVENT_READ, this);
+    add_channel_event(timer_fd, cc);
 }
 
 event_loop::~event_loop(){
-
+    //关闭的连接析构时会把未完成的段交给orphan的zerocopy_sender，必须先释放
+    close_channels();
+    //不再等待的段只能泄漏
+    for(auto& orphan : zerocopy_orphans){
+        orphan.sender->abandon();
+        delete orphan.sender;
+        close(orphan.fd);
+    }
+    for(int fd : {wakeup_fd, timer_fd})
+        if(map[fd])
+            dispatcher->close_channel(map[fd]);
+    map.release_closed();
+    delete dispatcher;
+    pthread_mutex_destroy(&task_mutex);
 }
 
 int event_loop::run(){
@@ -355,26 +633,51 @@ int event_loop::run(){
 
     while(!quit){
         log_msg("[%s] loop\n", thread_name);
-        //阻塞以等待I/O事件、或其他channel。
-        dispatcher.dispatch();
+        //等待I/O事件、或其他channel
+        poll_events();
+        handle_ready_channels();
         //处理的当前监听的事件列表。
         handle_pending_channel();
+        //工作线程送回的任务
+        handle_completions();
+        //run_in_loop/queue_in_loop投递的任务
+        handle_tasks();
+        //corked_writes下本轮积攒的发送
+        handle_flushes();
+        //释放本轮中关闭的channel，它们不能留在下一轮的ready_channels中
+        ready_channels.erase(std::remove_if(ready_channels.begin(), ready_channels.end(),
+                                [](channel* cc){ return cc->is_closed(); }),
+                            ready_channels.end());
+        map.release_closed();
+        if(!zerocopy_orphans.empty())
+            reap_zerocopy_orphans();
     }
 
+    //线程池中的event_loop由其他线程析构，连接要在这里释放
+    close_channels();
     return 0;
 }
 
-int event_loop::add_channel_event(int fd, channel* cc){
+void event_loop::close_channels(){
+    //wakeup和timer留到析构的最后，释放连接时还会用到定时器
+    for(auto cc : map.get_channels())
+        if(cc->get_fd() != wakeup_fd && cc->get_fd() != timer_fd)
+            dispatcher->close_channel(cc);
+    ready_channels.clear();
+    map.release_closed();
+}
+
+int event_loop::add_channel_event(int fd, channel* cc, bool need_wakeup){
     //log_msg("[%s] add event channel fd = %d\n", thread_name, fd);
-    return do_channel_event(fd, cc, 1);
+    return do_channel_event(fd, cc, PENDING_ADD, need_wakeup);
 }
 
 int event_loop::remove_channel_event(int fd, channel* cc){
-    return do_channel_event(fd, cc, 2);
+    return do_channel_event(fd, cc, PENDING_REMOVE);
 }
 
 int event_loop::update_channel_event(int fd, channel* cc){
-    return do_channel_event(fd, cc, 3);
+    return do_channel_event(fd, cc, PENDING_UPDATE);
 }
 
 void event_loop::assert_in_same_thread(){
@@ -384,8 +687,233 @@ void event_loop::assert_in_same_thread(){
     }
 }
 
-int event_loop::get_second_socket_fd(){
-    return socket_pair[1];
+int event_loop::get_wakeup_fd(){
+    return wakeup_fd;
+}
+
+void event_loop::clear_wakeup(){
+    wakeup_pending.store(false, std::memory_order_seq_cst);
+}
+
+long event_loop::get_wakeup_writes(){
+    return wakeup_writes.load(std::memory_order_relaxed);
+}
+
+event_loop_stats event_loop::get_stats(){
+    event_loop_stats stats{};
+    stats.dispatches = dispatches.load(std::memory_order_relaxed);
+    stats.wakeups = wakeups.load(std::memory_order_relaxed);
+    stats.events = dispatched_events.load(std::memory_order_relaxed);
+    stats.wakeup_writes = wakeup_writes.load(std::memory_order_relaxed);
+    stats.busy_poll_hits = busy_poll_hits.load(std::memory_order_relaxed);
+    stats.busy_poll_misses = busy_poll_misses.load(std::memory_order_relaxed);
+    stats.busy_poll_ns = busy_poll_ns.load(std::memory_order_relaxed);
+    stats.event_capacity = dispatcher->get_event_count();
+    stats.connections = get_connections();
+    stats.pending_bytes = get_pending_bytes();
+    stats.worker_completions = worker_completions.load(std::memory_order_relaxed);
+    stats.tasks = tasks_run.load(std::memory_order_relaxed);
+    stats.task_batches = task_batches.load(std::memory_order_relaxed);
+    stats.last_task_batch = last_task_batch.load(std::memory_order_relaxed);
+    stats.max_task_batch = max_task_batch.load(std::memory_order_relaxed);
+    stats.socket_reads = socket_reads.load(std::memory_order_relaxed);
+    stats.socket_writes = socket_writes.load(std::memory_order_relaxed);
+    stats.socket_accepts = socket_accepts.load(std::memory_order_relaxed);
+    stats.deferred_flushes = deferred_flushes.load(std::memory_order_relaxed);
+    return stats;
+}
+
+const event_loop_options& event_loop::get_options(){
+    return options;
+}
+
+void event_loop::add_connections(long n){
+    connections.fetch_add(n, std::memory_order_relaxed);
+}
+
+long event_loop::get_connections(){
+    return connections.load(std::memory_order_relaxed);
+}
+
+void event_loop::add_pending_bytes(long n){
+    pending_bytes.fetch_add(n, std::memory_order_relaxed);
+}
+
+long event_loop::get_pending_bytes(){
+    return pending_bytes.load(std::memory_order_relaxed);
+}
+
+void event_loop::post_completion(worker_job* job){
+    worker_job* old_head = completions.load(std::memory_order_relaxed);
+    do{
+        job->completion_next = old_head;
+    }while(!completions.compare_exchange_weak(old_head, job,
+                std::memory_order_seq_cst, std::memory_order_relaxed));
+    //队列原本不为空时，event_loop已被唤醒或会在本轮取走它，一批完成只需唤醒一次
+    if(!old_head)
+        wakeup();
+}
+
+void event_loop::set_worker_pool(worker_pool* pool){
+    p_worker_pool = pool;
+}
+
+worker_pool* event_loop::get_worker_pool(){
+    return p_worker_pool;
+}
+
+int event_loop::handle_completions(){
+    worker_job* p = completions.exchange(nullptr, std::memory_order_seq_cst);
+    if(!p)
+        return 0;
+
+    worker_job* ordered = nullptr;
+    while(p){
+        worker_job* next = p->completion_next;
+        p->completion_next = ordered;
+        ordered = p;
+        p = next;
+    }
+
+    int n{};
+    while(ordered){
+        worker_job* next = ordered->completion_next;
+        ordered->complete();
+        delete ordered;
+        ordered = next;
+        ++n;
+    }
+    worker_completions.store(worker_completions.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    return n;
+}
+
+void event_loop::run_in_loop(loop_task task){
+    if(is_in_same_thread())
+        task();
+    else
+        queue_in_loop(std::move(task));
+}
+
+void event_loop::queue_in_loop(loop_task task){
+    pthread_mutex_lock(&task_mutex);
+    bool was_empty = queued_tasks.empty();
+    queued_tasks.push_back(std::move(task));
+    queued_task_count.store(queued_tasks.size(), std::memory_order_seq_cst);
+    pthread_mutex_unlock(&task_mutex);
+    /*
+        队列原本不为空时，之前的投递者已经唤醒了event_loop，或event_loop还没有取走队列，
+        一批投递只需唤醒一次。本线程投递的任务由poll_events根据queued_task_count不阻塞地执行。
+    */
+    if(was_empty && !is_in_same_thread())
+        wakeup();
+}
+
+void event_loop::stop(){
+    queue_in_loop([this]{ quit = 1; });
+}
+
+int event_loop::handle_tasks(){
+    /*
+        每轮只交换一次队列，执行期间新投递的任务留到下一轮，避免任务不断投递任务时
+        饿死I/O事件。执行完清空running_tasks，保留其容量供下次交换。
+    */
+    if(!queued_task_count.load(std::memory_order_seq_cst))
+        return 0;
+
+    pthread_mutex_lock(&task_mutex);
+    running_tasks.swap(queued_tasks);
+    queued_task_count.store(0, std::memory_order_seq_cst);
+    pthread_mutex_unlock(&task_mutex);
+
+    long n = running_tasks.size();
+    for(auto& task : running_tasks)
+        task();
+    running_tasks.clear();
+
+    //计数只由本线程写入
+    tasks_run.store(tasks_run.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    task_batches.store(task_batches.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    last_task_batch.store(n, std::memory_order_relaxed);
+    if(n > max_task_batch.load(std::memory_order_relaxed))
+        max_task_batch.store(n, std::memory_order_relaxed);
+    return n;
+}
+
+void event_loop::set_placement(int a_cpu, int a_numa_node){
+    cpu = a_cpu;
+    numa_node = a_numa_node;
+}
+
+int event_loop::get_cpu(){
+    return cpu;
+}
+
+int event_loop::get_numa_node(){
+    return numa_node;
+}
+
+void event_loop::close_channel(channel* cc){
+    assert_in_same_thread();
+    dispatcher->close_channel(cc);
+}
+
+timer_id event_loop::run_after(int64_t delay_ms, std::function<void()> callback){
+    assert_in_same_thread();
+    timer_id id = timers.add(delay_ms, 0, std::move(callback));
+    int64_t expire_ms = timers.expire_ms(id);
+    if(timer_deadline_ms == -1 || expire_ms < timer_deadline_ms)
+        arm_timer_fd(expire_ms);
+    return id;
+}
+
+timer_id event_loop::run_every(int64_t interval_ms, std::function<void()> callback){
+    assert_in_same_thread();
+    timer_id id = timers.add(interval_ms, interval_ms, std::move(callback));
+    int64_t expire_ms = timers.expire_ms(id);
+    if(timer_deadline_ms == -1 || expire_ms < timer_deadline_ms)
+        arm_timer_fd(expire_ms);
+    return id;
+}
+
+void event_loop::cancel(timer_id id){
+    assert_in_same_thread();
+    //还有其他定时器时不重新计算，timerfd最多提前触发一次，handle_timers中再设置
+    if(timers.cancel(id) && !timers.size())
+        arm_timer_fd(-1);
+}
+
+bool event_loop::is_timer_active(timer_id id){
+    return timers.is_active(id);
+}
+
+int event_loop::handle_timers(){
+    int fired = timers.expire();
+    update_timer_fd();
+    return fired;
+}
+
+void event_loop::queue_read(channel* cc){
+    assert_in_same_thread();
+    if(std::find(ready_channels.begin(), ready_channels.end(), cc) == ready_channels.end())
+        ready_channels.push_back(cc);
+}
+
+void event_loop::queue_flush(channel* cc){
+    assert_in_same_thread();
+    flush_channels.push_back(cc);
+}
+
+void event_loop::add_socket_reads(long n){
+    //只由本线程写入
+    socket_reads.store(socket_reads.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void event_loop::add_socket_writes(long n){
+    socket_writes.store(socket_writes.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void event_loop::add_socket_accepts(long n){
+    socket_accepts.store(socket_accepts.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
 }
 
 const char* event_loop::get_thread_name(){
@@ -403,66 +931,39 @@ int event_loop::handle_pending_channel(){
         故将I/O线程同业务逻辑线程隔离，令I/O线程只专注于处理I/O交换，业务逻辑线程处理
         业务，是比较常见的做法。
     */
-    pthread_mutex_lock(&mutex);
-    is_handle_pending = 1;
-
-    for(channel_element* p = pending_front; p != nullptr; p = p->next()){
-        channel* cc = p->get_channel();
-        switch(p->type()){
-        case 1:{
-            handle_pending_add(cc);
-            break;
-        }
-        case 2:{
-            handle_pending_remove(cc);
-            break;
-        }
-        case 3:{
-            handle_pending_update(cc);
-            break;
-        }
-        default:
-            ;
-        }
+    channel* p = pending.pop_all();
+    while(p){
+        channel* next;
+        int ops = pending_channel_queue::take(p, next);
+
+        //add时已按当前的events注册，合并进来的update无需再做
+        if(ops & PENDING_ADD)
+            handle_pending_add(p);
+        else if(ops & PENDING_UPDATE)
+            handle_pending_update(p);
+        if(ops & PENDING_REMOVE)
+            handle_pending_remove(p);
+
+        p = next;
     }
-
-    clear_pending_channel();
-    
-    is_handle_pending = 0;
-    pthread_mutex_unlock(&mutex);
     return 0;
 }
 
-void event_loop::channel_buffer_nolock(int fd, channel* cc, int type){
-    channel_element* ce = new channel_element(cc, type);
-    //log_msg("[%s] struct insert channel fd = %d\n", thread_name, fd);
-    if(!pending_front)
-        pending_front = pending_back = ce;
-    else{
-        pending_back->set_next(ce);
-        pending_back = ce;
-    }
-}
-
-int event_loop::do_channel_event(int fd, channel* cc, int type){
+int event_loop::do_channel_event(int fd, channel* cc, int type, bool need_wakeup){
     /*
         主线程往子线程的数据中增加需要处理的channel event对象，所增加的channel
-        对象以链表的形式维护在子线程的数据结构中。
+        对象以侵入式链表的形式维护在子线程的无锁队列中。
+        同一个channel尚未被处理的多次操作合并为一次入队。
     */
     //log_msg("[%s] do channel event channel fd = %d\n", thread_name, cc->get_fd());
-    //上锁
-    pthread_mutex_lock(&mutex);
-
-    assert(!is_handle_pending);
-    //log_msg("[%s] ready to add channel fd = %d\n", thread_name, cc->get_fd());
-    //向该线程的channel列表中增加新的channel
-    channel_buffer_nolock(fd, cc, type);
+    pending.push(cc, type);
 
-    pthread_mutex_unlock(&mutex);
     //若是主线程发起操作，就需要调用wakeup()唤醒子线程，否则如果是子线程
     //自己操作，就可以直接操作
-    if(!is_in_same_thread())
-        wakeup();
+    if(!is_in_same_thread()){
+        if(need_wakeup)
+            wakeup();
+    }
     else
         handle_pending_channel();
     
@@ -475,8 +976,12 @@ int event_loop::handle_pending_add(channel* cc){
     if(fd < 0)
         return 0;
 
+    if(map[fd] == cc || cc->is_closed())
+        return 0;
+
     map.insert(fd, cc);
-    dispatcher.add(cc);
+    dispatcher->add(cc);
+    cc->registered();
 
     return 0;
     
@@ -488,9 +993,11 @@ int event_loop::handle_pending_remove(channel* cc){
         return 0;
     
     channel* c = map[fd];
+    if(c != cc)
+        return 0;
     int retval{};
 
-    if(dispatcher.remove(c))
+    if(dispatcher->remove(c))
         retval = -1;
     else
         retval = 1;
@@ -505,10 +1012,10 @@ int event_loop::handle_pending_update(channel* cc){
     int fd = cc->get_fd();
     if(fd < 0)
         return 0;
-    if(!map.contains(fd))
+    if(map[fd] != cc)
         return -1;
     
-    dispatcher.update(cc);
+    dispatcher->update(cc);
 
     return 0;
 }
@@ -518,24 +1025,160 @@ bool event_loop::is_in_same_thread(){
 }
 
 int event_loop::wakeup(){
+    //已经有一次唤醒在途，子线程苏醒后会一并处理队列中的全部channel
+    if(wakeup_pending.exchange(true, std::memory_order_seq_cst))
+        return 0;
+
     log_msg("[%s] wakeup\n", thread_name);
-    char a = 'a';
-    ssize_t n = write(socket_pair[0], &a, sizeof(a));
+    wakeup_writes.fetch_add(1, std::memory_order_relaxed);
+    uint64_t one = 1;
+    ssize_t n = write(wakeup_fd, &one, sizeof(one));
 
-    if(n != sizeof(a))
+    if(n != sizeof(one))
         log_err("wakeup event loop thread failed");
 
     return 0;
 }
 
-void event_loop::clear_pending_channel(){
-    channel_element* t;
-    while(pending_front){
-        t = pending_front;
-        pending_front = pending_front->next();
-        delete t;
+int event_loop::handle_ready_channels(){
+    /*
+        处理上一轮没有读完的channel。本轮dispatch中已经被关闭的跳过，
+        处理过程中再次用尽预算的channel会重新进入ready_channels。
+    */
+    handling_channels.swap(ready_channels);
+    int n = handling_channels.size();
+    for(auto cc : handling_channels)
+        if(!cc->is_closed() && map.activate(cc, EVENT_READ))
+            dispatcher->close_channel(cc);
+    handling_channels.clear();
+    return n;
+}
+
+int event_loop::handle_flushes(){
+    /*
+        在释放本轮关闭的channel之前调用，已经关闭的跳过。flush中的output_drained可能
+        又写入数据、排入新的flush，按下标遍历，本轮一并发出。
+    */
+    if(flush_channels.empty())
+        return 0;
+    size_t n{};
+    for(; n < flush_channels.size(); ++n){
+        channel* cc = flush_channels[n];
+        if(!cc->is_closed() && cc->flush())
+            dispatcher->close_channel(cc);
+    }
+    flush_channels.clear();
+    deferred_flushes.store(deferred_flushes.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    return n;
+}
+
+static int64_t now_ns(){
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void event_loop::adopt_zerocopy(channel* cc, int fd, zerocopy_sender* sender){
+    assert_in_same_thread();
+    //dup出的fd让文件保持打开，close原fd不会把它从epoll中删掉，之后的事件会指向已释放的channel
+    dispatcher->remove(cc);
+    log_msg("[%s] fd %d closed with zerocopy sends outstanding\n", thread_name, fd);
+    zerocopy_orphans.push_back({fd, sender, now_ns() + ZEROCOPY_ORPHAN_TIMEOUT_MS * 1000000});
+    //完成通知不再触发事件，由定时器唤醒本线程，在轮末读取
+    if(!zerocopy_timer)
+        zerocopy_timer = run_every(ZEROCOPY_REAP_INTERVAL_MS, []{});
+}
+
+void event_loop::reap_zerocopy_orphans(){
+    int64_t now = now_ns();
+    for(size_t i{}; i < zerocopy_orphans.size();){
+        zerocopy_orphan& orphan = zerocopy_orphans[i];
+        //套接字出错时仍会送来完成通知，只看是否全部完成
+        orphan.sender->reap(orphan.fd);
+        if(orphan.sender->has_outstanding() && now < orphan.deadline_ns){
+            ++i;
+            continue;
+        }
+        if(orphan.sender->has_outstanding()){
+            log_msg("[%s] fd %d: %zu zerocopy segments never completed, reset\n",
+                thread_name, orphan.fd, orphan.sender->get_held_count());
+            //复位连接，内核释放发送队列；段的内存不确定是否还在使用，不再回收
+            linger reset{1, 0};
+            setsockopt(orphan.fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+            orphan.sender->abandon();
+        }
+        delete orphan.sender;
+        close(orphan.fd);
+        zerocopy_orphans[i] = zerocopy_orphans.back();
+        zerocopy_orphans.pop_back();
+    }
+    if(zerocopy_orphans.empty() && zerocopy_timer){
+        cancel(zerocopy_timer);
+        zerocopy_timer = 0;
+    }
+}
+
+int event_loop::poll_events(){
+    /*
+        上一轮有没读完的channel、或队列中有待执行的任务时不阻塞。开启busy poll时先以dispatch(0)空转至多
+        busy_poll_us，期间取到事件就省去一次阻塞和唤醒的开销，到期仍没有事件才
+        阻塞等待。计数只由本线程写入，不需要原子的读改写。
+    */
+    auto count = [](std::atomic<long>& counter, long n){
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    };
+    int n;
+
+    if(!ready_channels.empty() || queued_task_count.load(std::memory_order_seq_cst)){
+        n = dispatcher->dispatch(0);
+        count(dispatches, 1);
+        count(dispatched_events, n);
+        return n;
+    }
+
+    if(options.busy_poll_us > 0){
+        int64_t start = now_ns();
+        int64_t deadline = start + int64_t(options.busy_poll_us) * 1000;
+        int64_t now;
+        do{
+            n = dispatcher->dispatch(0);
+            count(dispatches, 1);
+            now = now_ns();
+            if(n > 0){
+                count(busy_poll_hits, 1);
+                count(busy_poll_ns, now - start);
+                count(dispatched_events, n);
+                return n;
+            }
+        }while(now < deadline);
+        count(busy_poll_misses, 1);
+        count(busy_poll_ns, now - start);
+    }
+
+    n = dispatcher->dispatch(-1);
+    count(dispatches, 1);
+    count(wakeups, 1);
+    count(dispatched_events, n);
+    return n;
+}
+
+void event_loop::update_timer_fd(){
+    arm_timer_fd(timers.next_expire_ms());
+}
+
+void event_loop::arm_timer_fd(int64_t expire_ms){
+    if(expire_ms == timer_deadline_ms)
+        return;
+
+    //一次性的绝对时间，不再按tick周期唤醒；已经过去的时间立即触发
+    itimerspec spec{};
+    if(expire_ms != -1){
+        spec.it_value.tv_sec = expire_ms / 1000;
+        spec.it_value.tv_nsec = (expire_ms % 1000) * 1000000;
     }
-    pending_back = nullptr;
+    if(timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr) == -1)
+        log_err("timerfd settime failed\n");
+    timer_deadline_ms = expire_ms;
 }
 
 //event_loop_thread
@@ -545,18 +1188,22 @@ event_loop_thread::event_loop_thread() :
     mutex{},
     cond{},
     thread{},
-    thread_name{}
+    thread_name{},
+    loop_options{},
+    cpu(-1),
+    is_stopped{}
 {
     pthread_mutex_init(&mutex, nullptr);
     pthread_cond_init(&cond, nullptr);
 }
 
 event_loop_thread::~event_loop_thread(){
+    stop();
     delete[] thread_name;
     delete m_event_loop;
 }
 
-event_loop* event_loop_thread::start(int no){
+event_loop* event_loop_thread::start(int no, const event_loop_options& options){
     /*
         用于主线程创建子线程。子线程一旦创建，就立即执行thread::run，其作用是
         初始化event_loop对象。run在完成后会调用pthread_cond_signal来通知start()中
@@ -568,20 +1215,38 @@ event_loop* event_loop_thread::start(int no){
     char* name = new char[32];
     sprintf(name, "thread %d\0", no);
     thread_name = name;
+    loop_options = options;
+
+    //创建时就绑定好CPU，线程从第一条指令起就不会迁移
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if(!options.cpu_list.empty()){
+        cpu = options.cpu_list[no % options.cpu_list.size()];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
 
-    pthread_create(&thread_id,
-                    nullptr,
-                    [](void* pt)->void* {
+    auto routine = [](void* pt)->void* {
                         return reinterpret_cast<::event_loop_thread*>(pt)->run();
-                    },
-                    this);//
+                    };
+    if(pthread_create(&thread_id, &attr, routine, this)){
+        //CPU不存在或不在本进程允许的范围内
+        log_err("[event loop thread] %s can not bind cpu %d, left unbound\n", thread_name, cpu);
+        cpu = -1;
+        if(pthread_create(&thread_id, nullptr, routine, this))
+            throw std::runtime_error("pthread create failed");
+    }
+    pthread_attr_destroy(&attr);
 
-    assert(!pthread_mutex_lock(&mutex));
+    //不能写在assert中，定义NDEBUG时会被整句去掉
+    pthread_mutex_lock(&mutex);
 
     while(!m_event_loop)
-        assert(!pthread_cond_wait(&cond, &mutex));
+        pthread_cond_wait(&cond, &mutex);
     
-    assert(!pthread_mutex_unlock(&mutex));
+    pthread_mutex_unlock(&mutex);
     
     log_msg("[event loop thread] started, %s\n", thread_name);
 
@@ -597,8 +1262,25 @@ void* event_loop_thread::run(){
     */
     pthread_mutex_lock(&mutex);
 
-    m_event_loop = new event_loop(thread_name);
-    
+    /*
+        event_loop及其数组在本线程中创建，按first-touch分配在本线程所在的节点上。
+        设置首选节点后，之后在本线程中分配的内存（连接的读写等）也留在该节点。
+    */
+    int node = -1;
+    if(cpu >= 0 && loop_options.numa_local){
+        node = get_cpu_node(cpu);
+        if(node >= 0 && set_preferred_node(node))
+            log_err("[event loop thread] %s set_mempolicy failed: %s\n", thread_name, strerror(errno));
+    }
+
+    m_event_loop = new event_loop(thread_name, loop_options);
+    m_event_loop->set_placement(cpu, node);
+
+    if(cpu >= 0)
+        log_msg("[event loop thread] %s pinned to cpu %d (running on %d), numa node %d%s\n",
+                thread_name, cpu, sched_getcpu(), get_cpu_node(cpu), node >= 0 ? ", local memory" : "");
+    else
+        log_msg("[event loop thread] %s unpinned, running on cpu %d\n", thread_name, sched_getcpu());
     log_msg("[event loop thread] init and signal %s\n", thread_name);
 
     pthread_cond_signal(&cond);
@@ -610,17 +1292,28 @@ void* event_loop_thread::run(){
     return{};
 }
 
+void event_loop_thread::stop(){
+    if(!m_event_loop || is_stopped)
+        return;
+    m_event_loop->stop();
+    pthread_join(thread_id, nullptr);
+    is_stopped = true;
+}
+
 event_loop* event_loop_thread::get_event_loop(){
     return m_event_loop;
 }
 
 //thread_pool
-thread_pool::thread_pool(event_loop* a_main_loop, int a_thread_number) :
+thread_pool::thread_pool(event_loop* a_main_loop, int a_thread_number, const event_loop_options& options) :
     is_started{},
     p_main_loop(a_main_loop),
     thread_number(a_thread_number),
     event_loop_threads(nullptr),
-    position{}{
+    position{},
+    loop_options(options),
+    policy(placement_round_robin),
+    random_state(0x9e3779b97f4a7c15ULL){
 
     }
 
@@ -639,37 +1332,114 @@ void thread_pool::start(){
     
     event_loop_threads = new event_loop_thread[thread_number];
     for(int i{}; i!= thread_number; ++i)
-        event_loop_threads[i].start(i);
+        event_loop_threads[i].start(i, loop_options);
 }
 
 event_loop* thread_pool::get_event_loop(){
     assert(is_started);
     p_main_loop->assert_in_same_thread();
 
-    auto selected = p_main_loop;
-
-    if(thread_number > 0){
-        selected = event_loop_threads[position].get_event_loop();
-        if(++position >= thread_number)
-            position = 0;
+    if(thread_number <= 0)
+        return p_main_loop;
+
+    switch(policy){
+    case placement_least_connections:
+        return least_loaded(false);
+    case placement_least_pending_bytes:
+        return least_loaded(true);
+    case placement_power_of_two:
+        return power_of_two();
+    default:
+        break;
     }
 
+    auto selected = event_loop_threads[position].get_event_loop();
+    if(++position >= thread_number)
+        position = 0;
+    return selected;
+}
+
+event_loop* thread_pool::get_event_loop(int index){
+    assert(is_started);
+    if(thread_number <= 0)
+        return p_main_loop;
+    return event_loop_threads[index % thread_number].get_event_loop();
+}
+
+void thread_pool::stop(){
+    if(!event_loop_threads)
+        return;
+    //先全部通知，再逐个join
+    for(int i{}; i != thread_number; ++i)
+        event_loop_threads[i].get_event_loop()->stop();
+    for(int i{}; i != thread_number; ++i)
+        event_loop_threads[i].stop();
+}
+
+int thread_pool::get_thread_number(){
+    return thread_number;
+}
+
+void thread_pool::set_placement_policy(placement_policy a_policy){
+    policy = a_policy;
+}
+
+event_loop* thread_pool::least_loaded(bool by_bytes){
+    /*
+        计数由各个loop自己更新，这里读到的可能稍有滞后，但分配只需要大致的比较。
+        每次从不同的位置开始找，负载都为0时也能轮流分配。
+    */
+    event_loop* selected{};
+    long min_load{};
+    for(int i{}; i != thread_number; ++i){
+        event_loop* loop = event_loop_threads[(position + i) % thread_number].get_event_loop();
+        long load = by_bytes ? loop->get_pending_bytes() : loop->get_connections();
+        if(!selected || load < min_load){
+            selected = loop;
+            min_load = load;
+        }
+    }
+    if(++position >= thread_number)
+        position = 0;
     return selected;
 }
 
+event_loop* thread_pool::power_of_two(){
+    //xorshift64，只在主线程中使用，不需要加锁
+    auto next = [this]{
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 7;
+        random_state ^= random_state << 17;
+        return random_state;
+    };
+    event_loop* a = event_loop_threads[next() % thread_number].get_event_loop();
+    event_loop* b = event_loop_threads[next() % thread_number].get_event_loop();
+    if(a->get_connections() != b->get_connections())
+        return a->get_connections() < b->get_connections() ? a : b;
+    return a->get_pending_bytes() <= b->get_pending_bytes() ? a : b;
+}
+
 //buffer
 // static const int INIT_BUFFER_SIZE = 1048576;
 static const int INIT_BUFFER_SIZE = 65536;
 
 buffer::buffer() :
-    data(new char[INIT_BUFFER_SIZE]),
+    data(nullptr),
     read_position{},
     write_position{},
-    total_size(INIT_BUFFER_SIZE - 1)
-{}
+    total_size{}
+{
+    //buffer_pool关闭时保持原来的行为，构造时就分配
+    if(!buffer_pool::is_enabled()){
+        int block_size;
+        data = buffer_pool::local().acquire(INIT_BUFFER_SIZE, block_size);
+        total_size = block_size - 1;
+    }
+}
 
 buffer::~buffer(){
-    delete[] data;
+    if(data)
+        buffer_pool::local().release(data, total_size + 1);
 }
 
 int buffer::get_writeable_size(){
@@ -718,11 +1488,16 @@ char buffer::read_char(){
 }  
 
 int buffer::socket_read(int fd){
-    char add_buf[INIT_BUFFER_SIZE];
+    //放不下的部分先读到线程的临时区，再按实际长度追加，不必预先为读留出大块空间
+    char* add_buf = buffer_pool::local().get_scratch();
     int max_writeable = get_writeable_size();
+    //读入后不超过buffer_pool的最大级别（末尾留一个字节放'\0'），剩余空间太小时才允许超出
+    int extra = std::max(BUFFER_MAX_POOLED_BLOCK - 1 - get_readable_size() - max_writeable, 0);
+    if(max_writeable + extra < BUFFER_MIN_BLOCK || extra > BUFFER_SCRATCH_SIZE)
+        extra = BUFFER_SCRATCH_SIZE;
     iovec vec[2]{
-        {data + write_position, max_writeable},
-        {add_buf, sizeof(add_buf)}
+        {data + write_position, size_t(max_writeable)},
+        {add_buf, size_t(extra)}
     };
     int result = readv(fd, vec, 2);
     if(result < 0)
@@ -736,7 +1511,8 @@ int buffer::socket_read(int fd){
         write_position = total_size;
         append(add_buf, result - max_writeable);
     }
-    data[write_position] = 0;
+    if(data)
+        data[write_position] = 0;
     return result;
 
 }
@@ -749,16 +1525,37 @@ char* buffer::find_CRLF(){
 int buffer::send(tcp_connection* t){
     int size = get_readable_size();
     int result = t->send_data(data + read_position, size);
-    read_position += size;
+    consume(size);
     //log_msg("[connection] send %d bytes, now buffer size is %d bytes\n", size, total_size);
     return result;
 }
 
+void buffer::bind_numa_node(int node){
+    if(data && bind_memory_node(data, total_size + 1, node))
+        log_msg("[buffer] mbind to node %d failed: %s\n", node, strerror(errno));
+}
+
 void buffer::clear(){
     read_position = 0;
     write_position = 0;
 }
 
+void buffer::consume(int size){
+    read_position += std::min(size, get_readable_size());
+    if(read_position == write_position)
+        clear();
+}
+
+void buffer::release(){
+    if(!data || get_readable_size() || !buffer_pool::is_enabled())
+        return;
+    buffer_pool::local().release(data, total_size + 1);
+    data = nullptr;
+    read_position = 0;
+    write_position = 0;
+    total_size = 0;
+}
+
 auto buffer::capacity(){
     return total_size;
 }
@@ -768,22 +1565,23 @@ void buffer::make_room(int size){
         return;
     
     int readable_size = get_readable_size();
-    if(get_front_spare_size() + get_writeable_size() >= size){//当前空余空间足够
-        
-        // if(read_position > readable_size)
-        //     memcpy(data, data + read_position, readable_size);
-        // else
-        for(int i{}; i!= readable_size; ++i)
-            memcpy(data + i, data + read_position + i, i);
-            
+    if(data && get_front_spare_size() + get_writeable_size() >= size){//当前空余空间足够
+        memmove(data, data + read_position, readable_size);
     }
     else{
-        char* new_space = new char[total_size + size + 1];
-        memcpy(new_space, data + read_position, readable_size);
-        delete data;
+        //末尾留一个字节放'\0'。级别以内acquire已经按2倍取整，超出最大级别后再按2倍增长
+        int need = readable_size + size + 1;
+        if(need > BUFFER_MAX_POOLED_BLOCK)
+            need = std::max(need, 2 * (total_size + 1));
+        int block_size;
+        char* new_space = buffer_pool::local().acquire(need, block_size);
+        if(readable_size)
+            memcpy(new_space, data + read_position, readable_size);
+        if(data)
+            buffer_pool::local().release(data, total_size + 1);
 
         data = new_space;
-        total_size += size;
+        total_size = block_size - 1;
     }
 
     read_position = 0;
@@ -791,33 +1589,93 @@ void buffer::make_room(int size){
 
 }
 
+//connection_job
+class connection_job : public worker_job{
+/*
+    tcp_connection::run_in_worker提交的任务。连接先于任务释放时p_connection被置空，
+    任务完成后直接丢弃。
+*/
+public:
+    connection_job(tcp_connection* a_connection, std::function<void()> a_work, std::function<void()> a_done) :
+        worker_job(a_connection->p_event_loop),
+        p_connection(a_connection),
+        work(std::move(a_work)),
+        done(std::move(a_done))
+    {}
+
+    void run() override{
+        work();
+    }
+
+    void complete() override{
+        if(p_connection)
+            p_connection->worker_job_completed(this);
+    }
+
+    tcp_connection* p_connection;
+    std::function<void()> work;
+    std::function<void()> done;
+};
+
 //tcp_connection
 tcp_connection::tcp_connection(int connect_fd, event_loop* a_event_loop) :
                 p_event_loop(a_event_loop),
                 input_buffer(new buffer),
-                output_buffer(new buffer)
+                output_buffer(new chain_buffer),
+                high_watermark(OUTPUT_HIGH_WATERMARK),
+                low_watermark(OUTPUT_LOW_WATERMARK),
+                reading_paused{},
+                reading_held{},
+                input_closed{},
+                shutdown_pending{},
+                flush_queued{},
+                drain_wanted{},
+                zerocopy(new zerocopy_sender),
+                reported_pending_bytes{}
 {
     /*
         tcp_connection代表一个连接，构造意味着连接建立。
-        主要操作是创建一个channel对象，然后把该对象注册到event_loop中。
+        主要操作是创建一个channel对象，注册到event_loop中则推迟到connection_established，
+        否则从reactor线程可能在派生类构造完成之前就回调message。
     */
     name = new char[32];
     sprintf(name, "connection-%d\0", connect_fd);
 
     m_channel = new connection_channel(connect_fd, EVENT_READ, p_event_loop, this);
 
-    p_event_loop->add_channel_event(connect_fd, m_channel);
+    //连接在主线程中创建、且缓冲区已经分配（buffer_pool关闭）时，迁移到服务它的loop所在的节点
+    int node = p_event_loop->get_numa_node();
+    if(node >= 0 && !p_event_loop->is_in_same_thread()){
+        input_buffer->bind_numa_node(node);
+    }
+    //在分配连接的线程中立即计入，同一批accept中的下一个连接就能看到
+    p_event_loop->add_connections(1);
 }
 
 tcp_connection::~tcp_connection(){
     //delete m_channel;
+    cancel_timers();
     delete[] name;
 
+    p_event_loop->add_connections(-1);
+    p_event_loop->add_pending_bytes(-reported_pending_bytes);
+
+    //已提交的任务还在工作线程中，完成后由event_loop释放；其余的还没提交，直接释放
+    if(!worker_jobs.empty()){
+        worker_jobs.front()->p_connection = nullptr;
+        for(size_t i = 1; i < worker_jobs.size(); ++i)
+            delete worker_jobs[i];
+    }
+
+    //未完成的MSG_ZEROCOPY段交给已由event_loop接管的zerocopy，完成后才释放
     delete output_buffer;
     delete input_buffer;
+    delete zerocopy;
 }
 
 int tcp_connection::message(buffer* buf){
+    //没有处理的数据会一直留在input_buffer中，默认全部丢弃
+    buf->consume(buf->get_readable_size());
     return 0;
 }
 
@@ -825,17 +1683,34 @@ int tcp_connection::write_completed(){
     return 0;
 }
 
+int tcp_connection::output_drained(){
+    return 0;
+}
+
 int tcp_connection::connection_closed(){
     return 0;
 }
 
+int tcp_connection::connection_opened(){
+    return 0;
+}
+
 int tcp_connection::send_data(const void* data, int size){
-    size_t nwrited{},
-        nleft(size),
-        fault{};
+    ssize_t nwrited{};
+    size_t nleft(size);
+    int fault{};
+
+    if(is_closed())
+        return -1;
     
-    if(!m_channel->get_write_event() && !output_buffer->get_readable_size()){
-        nwrited = write(m_channel->get_fd(), data, size);
+    if(defer_write()){
+        output_buffer->append(data, size);
+        return 0;
+    }
+
+    if(!m_channel->get_write_event() && output_buffer->empty()){
+        nwrited = ::send(m_channel->get_fd(), data, size, MSG_NOSIGNAL);
+        p_event_loop->add_socket_writes(1);
         if(nwrited >= 0)
             nleft -= nwrited;
         else{
@@ -849,14 +1724,315 @@ int tcp_connection::send_data(const void* data, int size){
 
     if(!fault && nleft > 0){
         output_buffer->append(const_pointer_cast<char*>(data) + nwrited, nleft);
-        if(!m_channel->get_write_event())
-            m_channel->set_write_event_enable(1);
+        output_queued();
     }
 
     return nwrited;
 }
 
-void tcp_connection::shutdown_connection(){
-    if(shutdown(m_channel->get_fd(), SHUT_WR) < 0)
+long tcp_connection::send_chain(chain_buffer* chain){
+    long nwrited{};
+    int fault{};
+
+    if(is_closed()){
+        chain->clear();
+        return -1;
+    }
+
+    if(defer_write()){
+        output_buffer->append_chain(*chain);
+        return 0;
+    }
+
+    //前面还有没发完的数据时只能排在它们后面
+    if(!m_channel->get_write_event() && output_buffer->empty()){
+        long syscalls{};
+        nwrited = chain->write_to(m_channel->get_fd(), zerocopy, &syscalls);
+        p_event_loop->add_socket_writes(syscalls);
+        if(nwrited < 0){
+            nwrited = 0;
+            if(errno == EPIPE || errno == ECONNRESET)
+                fault = 1;
+        }
+    }
+
+    if(fault)
+        chain->clear();
+    else if(!chain->empty()){
+        output_buffer->append_chain(*chain);
+        output_queued();
+    }
+
+    return nwrited;
+}
+
+void tcp_connection::connection_established(bool need_wakeup){
+    p_event_loop->add_channel_event(m_channel->get_fd(), m_channel, need_wakeup);
+}
+
+bool tcp_connection::is_closed(){
+    return m_channel->is_closed();
+}
+
+void tcp_connection::force_close(){
+    //此后不会再有回调，定时器也不必等到析构时再取消
+    cancel_timers();
+    p_event_loop->close_channel(m_channel);
+}
+
+timer_id tcp_connection::run_after(int64_t delay_ms, std::function<void()> callback){
+    //顺便清理已经触发过的一次性定时器
+    for(size_t i{}; i < timers.size();){
+        if(!p_event_loop->is_timer_active(timers[i])){
+            timers[i] = timers.back();
+            timers.pop_back();
+        }
+        else
+            ++i;
+    }
+    timer_id id = p_event_loop->run_after(delay_ms, std::move(callback));
+    timers.push_back(id);
+    return id;
+}
+
+timer_id tcp_connection::run_every(int64_t interval_ms, std::function<void()> callback){
+    timer_id id = p_event_loop->run_every(interval_ms, std::move(callback));
+    timers.push_back(id);
+    return id;
+}
+
+void tcp_connection::cancel(timer_id id){
+    p_event_loop->cancel(id);
+}
+
+void tcp_connection::update_pending_bytes(){
+    long now = input_buffer->get_readable_size() + output_buffer->get_readable_size();
+    if(now != reported_pending_bytes){
+        p_event_loop->add_pending_bytes(now - reported_pending_bytes);
+        reported_pending_bytes = now;
+    }
+}
+
+void tcp_connection::set_output_watermarks(long high, long low){
+    high_watermark = high;
+    low_watermark = std::min(low, high);
+}
+
+bool tcp_connection::is_output_full(){
+    return output_buffer->get_readable_size() >= high_watermark;
+}
+
+void tcp_connection::wait_output_drained(){
+    drain_wanted = true;
+}
+
+void tcp_connection::pause_reading(){
+    if(reading_held)
+        return;
+    reading_held = true;
+    if(!reading_paused)
+        m_channel->set_read_event_enable(0);
+}
+
+void tcp_connection::resume_reading(){
+    if(!reading_held)
+        return;
+    reading_held = false;
+    if(!m_channel->is_closed())
+        restart_reading();
+}
+
+void tcp_connection::restart_reading(){
+    if(reading_paused || reading_held || input_closed)
+        return;
+    m_channel->set_read_event_enable(1);
+    //暂停期间到达的数据已经错过了边沿，下一轮主动读一次
+    p_event_loop->queue_read(m_channel);
+}
+
+int tcp_connection::handle_eof(){
+    if(output_buffer->empty())
+        return 1;
+    //对端只是半关闭，已经排队的响应仍要发出去
+    log_msg("[tcp connection] %s peer closed, %ld bytes left to send\n", name, output_buffer->get_readable_size());
+    input_closed = true;
+    if(!reading_paused && !reading_held)
+        m_channel->set_read_event_enable(0);
+    return 0;
+}
+
+void tcp_connection::check_output_drained(){
+    if(drain_wanted && output_buffer->get_readable_size() <= low_watermark){
+        drain_wanted = false;
+        output_drained();
+    }
+}
+
+int tcp_connection::set_zerocopy_threshold(long threshold){
+    return zerocopy->enable(m_channel->get_fd(), threshold);
+}
+
+int tcp_connection::handle_error(){
+    if(!zerocopy || !zerocopy->is_enabled())
+        return -1;
+    if(zerocopy->reap(m_channel->get_fd()) < 0){
+        log_msg("[tcp connection] %s socket error: %s\n", name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void tcp_connection::handle_closing(){
+    //内核在close之后仍会发送队列中的数据，段在完成通知到达之前不能释放
+    if(!zerocopy || !zerocopy->has_outstanding())
+        return;
+    int fd = dup(m_channel->get_fd());
+    if(fd < 0){
+        log_msg("[tcp connection] %s dup for zerocopy failed: %s\n", name, strerror(errno));
+        //等不到完成通知，段只能泄漏
+        zerocopy->abandon();
+        return;
+    }
+    //dup出的fd让套接字保持打开，以shutdown代替close的效果
+    shutdown(fd, SHUT_RDWR);
+    p_event_loop->adopt_zerocopy(m_channel, fd, zerocopy);
+    zerocopy = nullptr;
+}
+
+bool tcp_connection::defer_write(){
+    //已在等待EPOLLOUT时照常排在output_buffer之后
+    if(!p_event_loop->get_options().corked_writes || m_channel->get_write_event())
+        return false;
+    if(!flush_queued){
+        flush_queued = true;
+        p_event_loop->queue_flush(m_channel);
+    }
+    return true;
+}
+
+long tcp_connection::write_output(){
+    long syscalls{};
+    long n = output_buffer->write_to(m_channel->get_fd(), zerocopy, &syscalls);
+    p_event_loop->add_socket_writes(syscalls);
+    return n;
+}
+
+int tcp_connection::handle_flush(){
+    flush_queued = false;
+    //本轮中output_buffer已经积压、开启了写事件，剩下的由handle_write发送
+    if(m_channel->get_write_event() || output_buffer->empty())
+        return 0;
+
+    if(write_output() < 0){
+        log_msg("[tcp connection] %s write failed: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    if(!output_buffer->empty())
+        output_queued();
+    update_pending_bytes();
+    check_output_drained();
+
+    //本轮中的shutdown_connection在数据发出之后生效
+    if(shutdown_pending && output_buffer->empty()){
+        shutdown_pending = false;
+        shutdown_connection();
+    }
+    return input_closed && output_buffer->empty();
+}
+
+void tcp_connection::output_queued(){
+    if(!m_channel->get_write_event())
+        m_channel->set_write_event_enable(1);
+
+    if(!reading_paused && output_buffer->get_readable_size() >= high_watermark){
+        log_msg("[tcp connection] %s %ld bytes queued, pause reading\n", name, output_buffer->get_readable_size());
+        reading_paused = true;
+        m_channel->set_read_event_enable(0);
+    }
+}
+
+int tcp_connection::handle_write(){
+    if(!output_buffer->empty() && write_output() < 0){
+        log_msg("[tcp connection] %s write failed: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    if(reading_paused && output_buffer->get_readable_size() <= low_watermark){
+        log_msg("[tcp connection] %s %ld bytes queued, resume reading\n", name, output_buffer->get_readable_size());
+        reading_paused = false;
+        restart_reading();
+    }
+    update_pending_bytes();
+    //output_drained中可能又发送了数据
+    check_output_drained();
+
+    if(!output_buffer->empty())
+        return 0;
+
+    m_channel->set_write_event_enable(0);
+    write_completed();
+    //write_completed中可能又发送了数据
+    if(shutdown_pending && output_buffer->empty()){
+        shutdown_pending = false;
+        shutdown_connection();
+    }
+    return input_closed && output_buffer->empty();
+}
+
+void tcp_connection::release_idle_buffers(){
+    input_buffer->release();
+}
+
+void tcp_connection::run_in_worker(std::function<void()> work, std::function<void()> done){
+    worker_pool* pool = p_event_loop->get_worker_pool();
+    if(!pool){
+        work();
+        done();
+        return;
+    }
+
+    worker_jobs.push_back(new connection_job(this, std::move(work), std::move(done)));
+    if(worker_jobs.size() == 1)
+        pool->submit(worker_jobs.front());
+}
+
+bool tcp_connection::has_worker_jobs(){
+    return !worker_jobs.empty();
+}
+
+void tcp_connection::worker_job_completed(connection_job* job){
+    assert(!worker_jobs.empty() && worker_jobs.front() == job);
+    worker_jobs.pop_front();
+    //连接在本轮中已经关闭，其余的任务不再提交，done也不再调用
+    if(is_closed()){
+        for(auto pending_job : worker_jobs)
+            delete pending_job;
+        worker_jobs.clear();
+        return;
+    }
+    //先提交下一个，done中可能关闭连接
+    if(!worker_jobs.empty())
+        p_event_loop->get_worker_pool()->submit(worker_jobs.front());
+    job->done();
+}
+
+void tcp_connection::cancel_timers(){
+    for(auto id : timers)
+        p_event_loop->cancel(id);
+    timers.clear();
+}
+
+int tcp_connection::shutdown_connection(){
+    if(is_closed())
+        return -1;
+    if(!output_buffer->empty()){
+        shutdown_pending = true;
+        return 0;
+    }
+    if(shutdown(m_channel->get_fd(), SHUT_WR) < 0){
         log_msg("[tcp connection] shutdown failed, socket == %d\n", m_channel->get_fd());
+        return -1;
+    }
+    return 0;
 }
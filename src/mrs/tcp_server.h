@@ -2,13 +2,24 @@
 #define TCP_SERVER_H
 
 #include"common.h"
+#include"timer_wheel.h"
+#include"worker_pool.h"
+#include"loop_task.h"
+#include"buffer_pool.h"
+#include"chain_buffer.h"
 
 const int EVENT_READ = 0x2;
 const int EVENT_WRITE = 0x4;
 
+//channel上等待event_loop处理的操作，可以合并
+const int PENDING_ADD = 0x1;
+const int PENDING_REMOVE = 0x2;
+const int PENDING_UPDATE = 0x4;
+
 class event_loop;
 class tcp_connection;
 class TCPserver_base;
+class connection_job;
 
 
 class channel{
@@ -25,20 +36,46 @@ public:
 
     virtual int write();
 
+    //EPOLLERR时调用，返回0表示错误已处理、继续分发其余事件，否则关闭channel
+    virtual int error();
+
+    //由queue_flush排入，本轮事件处理完后调用，返回非0时关闭channel
+    virtual int flush();
+
+    //注册到event_dispatcher之后，在event_loop线程内调用
+    virtual int registered();
+
+    //关闭fd之前调用，此后不会再有事件
+    virtual void closing();
+
     void set_write_event_enable(bool enable);
 
     bool get_write_event();
 
+    void set_read_event_enable(bool enable);
+
+    bool get_read_event();
+
     int get_fd();
 
     int get_events();
 
     event_loop* get_event_loop();
 
+    bool is_closed();
+
 private:
+    friend class pending_channel_queue;
+    friend class channel_map;
+
     int fd;
     int events;
     event_loop* p_event_loop;
+    bool closed;
+
+    //pending_channel_queue的侵入式节点
+    channel* pending_next;
+    std::atomic<int> pending_ops;
 };
 
 class wakeup_channel : public channel{
@@ -48,9 +85,30 @@ public:
     int read() override;
 };
 
+class timer_channel : public channel{
+/*
+    timerfd在时间轮最近的到期时间触发一次，由event_loop重新设置，没有定时器时不唤醒。
+*/
+public:
+    timer_channel(int a_fd, int a_events, event_loop* a_event_loop);
+
+    int read() override;
+};
+
+//一次读事件中每个连接最多readv的次数，用尽后排到下一轮继续读，避免一个连接独占event_loop
+const int READ_BUDGET = 16;
+//message处理后input_buffer中仍积压这么多字节时也排到下一轮，一次读事件不会让缓冲区无限增长
+const int INPUT_HIGH_WATERMARK = BUFFER_MAX_POOLED_BLOCK / 2;
+
+//连接关闭后等待MSG_ZEROCOPY完成通知的时间上限，以及期间读取通知的间隔
+const int64_t ZEROCOPY_ORPHAN_TIMEOUT_MS = 60000;
+const int64_t ZEROCOPY_REAP_INTERVAL_MS = 10;
+
 class connection_channel : public channel{
 /*
     该channel用于建立新连接。
+    边沿触发下一直读到EAGAIN，数据累积在连接的input_buffer中，message没有处理完的
+    部分留到下次读到数据时一起处理。
 */
 public:
     connection_channel(int a_fd, int a_events, event_loop* a_event_loop, tcp_connection* a_tcp_connection);
@@ -59,6 +117,20 @@ public:
 
     int read() override;
 
+    //发送output_buffer中积压的数据
+    int write() override;
+
+    //取出MSG_ZEROCOPY的完成通知
+    int error() override;
+
+    //发出本轮中积攒在output_buffer中的数据
+    int flush() override;
+
+    int registered() override;
+
+    //还有未完成的MSG_ZEROCOPY发送时交给event_loop等待
+    void closing() override;
+
 private:
     tcp_connection* p_tcp_connection;
 };
@@ -77,12 +149,17 @@ private:
 };
 
 class channel_map{
+/*
+    以fd为下标的平坦数组，fd超出当前容量时按倍数增长。
+    epoll_event中直接携带channel指针，分发时无需查表，该表只负责登记和回收。
+*/
 public:
     channel_map();
 
     ~channel_map();
 
-    int activate(int fd, int events);
+    //回调读写，read出错时返回-1，由调用者经dispatcher关闭channel
+    int activate(channel* cc, int events);
 
     int insert(int fd, channel* cc);
 
@@ -92,38 +169,167 @@ public:
 
     void remove(int fd);
 
+    void close_channel(channel* cc);
+
+    void release_closed();
+
+    int size();
+
+    //仍登记着的全部channel，按fd排列
+    std::vector<channel*> get_channels();
+
 private:
-    std::map<int, channel*> m_map;
+    std::vector<channel*> m_channels;
+    int m_size;
+    //已关闭的channel推迟到本轮事件处理完后再释放，同一批epoll_event中可能还有它的指针
+    std::vector<channel*> closed_channels;
 };
 
 const int MAX_EVENTS = 128;
+const int MAX_EVENTS_LIMIT = 8192;
+
+enum dispatcher_backend{
+    backend_epoll,
+    //只用io_uring的multishot poll取代epoll做就绪通知，读写和accept仍是普通的系统调用
+    backend_uring_poll,
+};
+
+struct event_loop_options{
+/*
+    event_loop的配置，由TCPserver传给主线程和线程池中的每个event_loop。
+*/
+    dispatcher_backend backend;
+    //一次dispatch最多取出的事件数，取满时自动加倍，直到max_events_limit
+    int max_events;
+    int max_events_limit;
+    //阻塞之前以dispatch(0)空转的最长时间（微秒），0为不空转
+    int busy_poll_us;
+    //新连接上设置的SO_BUSY_POLL（微秒），0为不设置
+    int socket_busy_poll_us;
+    //从reactor线程依次绑定的CPU，第i个线程绑定cpu_list[i % size]，为空时不绑定
+    std::vector<int> cpu_list;
+    //绑定CPU后，线程和它的连接的内存分配放在该CPU所在的NUMA节点上
+    bool numa_local;
+    /*
+        连接在一轮中发送的数据先留在output_buffer中，本轮的事件、任务都处理完后
+        每个连接以一次聚集写发出，分开发送的响应头和响应体、一批流水线请求的响应
+        可以合成一次系统调用和更少的TCP报文，代价是发送推迟到本轮结束。
+    */
+    bool corked_writes;
+
+    event_loop_options() :
+        backend(backend_epoll),
+        max_events(MAX_EVENTS),
+        max_events_limit(MAX_EVENTS_LIMIT),
+        busy_poll_us{},
+        socket_busy_poll_us{},
+        cpu_list{},
+        numa_local{},
+        corked_writes{}
+    {}
+};
+
+struct event_loop_stats{
+/*
+    event_loop的运行计数快照，可以在任意线程中获取，两次快照相减即得速率。
+*/
+    long dispatches;//dispatch调用次数，包括空转
+    long wakeups;//从阻塞的dispatch中返回的次数
+    long events;//取出的事件总数
+    long wakeup_writes;//其他线程写eventfd唤醒本线程的次数
+    long busy_poll_hits;//空转期间取到事件、省去一次阻塞和唤醒的次数
+    long busy_poll_misses;//空转到期仍没有事件、转入阻塞的次数
+    long busy_poll_ns;//空转花费的时间
+    int event_capacity;//当前的事件数组大小
+    long connections;//当前服务的连接数
+    long pending_bytes;//连接缓冲区中尚未处理完、尚未发出的字节数
+    long worker_completions;//从worker_pool送回并完成的任务数
+    long tasks;//执行的loop_task总数
+    long task_batches;//执行了至少一个loop_task的轮数
+    long last_task_batch;//最近一次执行的一批loop_task数
+    long max_task_batch;//一轮中执行的loop_task数的最大值
+    long socket_reads;//连接读取数据的系统调用次数，包括返回EAGAIN的一次
+    long socket_writes;//连接发送数据的系统调用次数，一次sendmsg/sendfile计一次
+    long socket_accepts;//监听套接字上accept4的调用次数，包括返回EAGAIN的一次
+    long deferred_flushes;//corked_writes下在轮末发送的连接数
+};
 
 class event_dispatcher{
+/*
+    事件分发的接口，由epoll_dispatcher和uring_dispatcher实现，在event_loop创建时选定。
+*/
 public:
-    event_dispatcher(channel_map* a_channel_map);
+    event_dispatcher(channel_map* a_channel_map, const event_loop_options& options);
+
+    virtual ~event_dispatcher();
+
+    virtual int add(channel* cc) = 0;
 
-    ~event_dispatcher();
+    virtual int remove(channel* cc) = 0;
 
-    int add(channel* cc);
+    virtual int update(channel* cc) = 0;
 
-    int remove(channel* cc);
+    //timeout_ms为-1时一直阻塞，为0时立即返回。返回取出的事件数
+    virtual int dispatch(int timeout_ms = -1) = 0;
 
-    int update(channel* cc);
+    //关闭channel，需要时先撤销它在后端上的监听
+    virtual void close_channel(channel* cc);
+
+    virtual const char* get_name() = 0;
+
+    int get_event_count();
+
+    //所有dispatcher发起的系统调用次数（epoll_wait、epoll_ctl、io_uring_enter），
+    //不包括连接的读写和accept，这些计在event_loop_stats中
+    static long get_syscalls();
+
+    //创建指定的后端，内核不支持时退回epoll
+    static event_dispatcher* create(channel_map* a_channel_map, const event_loop_options& options);
+
+protected:
+    //对一个已就绪的channel回调读写，events为EPOLLIN等
+    void handle_event(channel* cc, uint32_t events);
 
-    int dispatch();
+    //本次取满了事件数组时加倍event_count，返回true时由子类重新分配数组
+    bool grow_events(int n);
+
+    channel_map* p_channel_map;
+    int event_count;
+    int event_limit;
+    static std::atomic<long> syscalls;
+};
+
+class epoll_dispatcher : public event_dispatcher{
+public:
+    epoll_dispatcher(channel_map* a_channel_map, const event_loop_options& options);
+
+    ~epoll_dispatcher();
+
+    int add(channel* cc) override;
+
+    int remove(channel* cc) override;
+
+    int update(channel* cc) override;
+
+    int dispatch(int timeout_ms = -1) override;
+
+    const char* get_name() override;
     
 private:
     int do_modify(channel* cc, uint32_t type);
 
-    channel_map* p_channel_map;
-    int event_count;
     int nfds;
     int realloc_copy;
     int efd;
     epoll_event* m_events;
 };
 
+//连接的output_buffer超过高水位时暂停读取新的数据，降到低水位以下时恢复
+const long OUTPUT_HIGH_WATERMARK = 4 * 1024 * 1024;
+const long OUTPUT_LOW_WATERMARK = 1024 * 1024;
+
 const int LISTENQ = 1024;
+const int ACCEPT_BUDGET = 64;
 
 class acceptor{
 /*
@@ -138,7 +344,8 @@ class acceptor{
     线程。
 */
 public:
-    acceptor(int port);
+    //reuse_port为true时设置SO_REUSEPORT，多个acceptor可以绑定同一端口，由内核分发连接
+    acceptor(int port, bool reuse_port = false);
 
     int get_listen_fd();
 
@@ -146,27 +353,31 @@ public:
 
 private:
     int listen_port;
-    int listen_fd;
+    int listen_fd;//由注册它的listen_channel关闭
 };
 
-class channel_element{
+class pending_channel_queue{
+/*
+    无锁多生产者单消费者队列，节点侵入在channel中，入队不分配内存。
+    生产者用CAS把channel压入栈顶，消费者用exchange一次取走整条链表并反转，
+    恢复先进先出的顺序，取走之后的处理不持有任何锁。
+*/
 public:
-    channel_element(channel* a_channel, int a_type, channel_element* a_next = nullptr);
+    pending_channel_queue();
 
-    ~channel_element();
-    
-    channel* get_channel();
-    
-    int type();
-    
-    channel_element* next();
-    
-    void set_next(channel_element* a_next);
+    //合并操作，channel不在队列中时才入队
+    void push(channel* cc, int ops);
+
+    //取走全部channel，按入队顺序链接
+    channel* pop_all();
+
+    //取出cc上合并的操作，并给出链表中的下一个channel
+    static int take(channel* cc, channel*& next);
+
+    bool empty();
 
 private:
-    channel* p_channel;
-    int m_type;//1:add;2:delete
-    channel_element* p_next;
+    std::atomic<channel*> head;
 };
 
 class event_loop{
@@ -174,13 +385,14 @@ class event_loop{
     整个反应堆模式的核心，event_dispatcher的作用是等待事件的发生。
 */
 public:
-    event_loop(const char* a_thread_name = "main thread");
+    event_loop(const char* a_thread_name = "main thread", const event_loop_options& options = event_loop_options());
 
     ~event_loop();
 
     int run();
 
-    int add_channel_event(int fd, channel* cc);
+    //need_wakeup为false时只入队不唤醒，由调用者在一批操作之后自行调用wakeup()
+    int add_channel_event(int fd, channel* cc, bool need_wakeup = true);
 
     int remove_channel_event(int fd, channel* cc);
 
@@ -188,43 +400,188 @@ public:
 
     void assert_in_same_thread();
 
-    int get_second_socket_fd();
+    bool is_in_same_thread();
+
+    int get_wakeup_fd();
+
+    void clear_wakeup();
+
+    long get_wakeup_writes();
+
+    event_loop_stats get_stats();
+
+    const event_loop_options& get_options();
+
+    //负载计数，连接的创建者和event_loop线程更新，thread_pool分配连接时读取
+    void add_connections(long n);
+
+    long get_connections();
+
+    void add_pending_bytes(long n);
+
+    long get_pending_bytes();
+
+    //由event_loop_thread在绑定CPU后设置，-1表示没有绑定
+    void set_placement(int a_cpu, int a_numa_node);
+
+    int get_cpu();
+
+    int get_numa_node();
+
+    void close_channel(channel* cc);
+
+    //定时器，只能在event_loop线程内调用
+    timer_id run_after(int64_t delay_ms, std::function<void()> callback);
+
+    timer_id run_every(int64_t interval_ms, std::function<void()> callback);
+
+    void cancel(timer_id id);
+
+    bool is_timer_active(timer_id id);
+
+    int handle_timers();
+
+    //channel在本轮中因预算用尽而没有读完，边沿触发下不会再收到通知，下一轮继续读
+    void queue_read(channel* cc);
+
+    //本轮的事件、任务都处理完后调用cc的flush，同一轮中只能排入一次
+    void queue_flush(channel* cc);
+
+    //由连接在读取、发送时计数
+    void add_socket_reads(long n);
+
+    void add_socket_writes(long n);
+
+    //由监听套接字所在的线程在accept时计数
+    void add_socket_accepts(long n);
+
+    int wakeup();
+
+    //工作线程执行完的任务送回本线程，可以在任意线程中调用
+    void post_completion(worker_job* job);
+
+    //连接可以把耗时的处理交给它，为空时在本线程内执行
+    void set_worker_pool(worker_pool* pool);
+
+    worker_pool* get_worker_pool();
+
+    /*
+        连接关闭时仍有MSG_ZEROCOPY发送没有完成，内核还会读取这些段的内存。接管套接字dup出的fd
+        和zerocopy_sender，每轮末尾读取完成通知，全部完成后再释放段、关闭fd；
+        超过ZEROCOPY_ORPHAN_TIMEOUT_MS仍未完成则复位连接，段的内存直接泄漏。
+        cc为正在关闭的channel，此时仍持有原fd。
+    */
+    void adopt_zerocopy(channel* cc, int fd, zerocopy_sender* sender);
+
+    //在本线程中调用时立即执行，否则等同queue_in_loop
+    void run_in_loop(loop_task task);
+
+    //任务放入队列，在本轮或下一轮的末尾一并执行，可以在任意线程中调用
+    void queue_in_loop(loop_task task);
+
+    //处理完当前一轮后run返回，可以在任意线程中调用。还在的连接不再处理
+    void stop();
     
     const char* get_thread_name();
 
 private:
     int handle_pending_channel();
 
-    void channel_buffer_nolock(int fd, channel* cc, int type);
-    
-    int do_channel_event(int fd, channel* cc, int type);
+    int do_channel_event(int fd, channel* cc, int type, bool need_wakeup = true);
     
     int handle_pending_add(channel* cc);
     
     int handle_pending_remove(channel* cc);
     
     int handle_pending_update(channel* cc);
-    
-    bool is_in_same_thread();
-    
-    int wakeup();
 
-    void clear_pending_channel();
+    //按时间轮最近的到期时间重新设置timerfd
+    void update_timer_fd();
+
+    //timerfd设为在expire_ms（CLOCK_MONOTONIC毫秒）触发一次，-1时停止
+    void arm_timer_fd(int64_t expire_ms);
+
+    int handle_ready_channels();
+
+    int handle_flushes();
+
+    int poll_events();
+
+    int handle_completions();
+
+    int handle_tasks();
+
+    //在release_closed之后调用，此时关闭的连接已经释放，不会再有段交给sender
+    void reap_zerocopy_orphans();
+
+    //关闭并释放仍登记着的连接、监听套接字，run退出时在本线程中调用，析构时再检查一次
+    void close_channels();
 
     const char* thread_name;
+    event_loop_options options;
     int quit;
     channel_map map;
-    event_dispatcher dispatcher;
+    event_dispatcher* dispatcher;
 
-    int socket_pair[2];//父线程用来通知子线程有新的事件需要处理。
+    int wakeup_fd;//父线程用来通知子线程有新的事件需要处理。
+    std::atomic<bool> wakeup_pending;//已有未被消费的唤醒，其余的唤醒可以省略
+    std::atomic<long> wakeup_writes;
     //保留在子线程内需要处理的新事件。
-    int is_handle_pending;
-    channel_element* pending_front;
-    channel_element* pending_back;
+    pending_channel_queue pending;
+
+    timer_wheel timers;
+    int timer_fd;
+    //timerfd当前设置的触发时间，-1表示未设置
+    int64_t timer_deadline_ms;
+
+    std::vector<channel*> ready_channels;
+    std::vector<channel*> handling_channels;
+    std::vector<channel*> flush_channels;
+
+    struct zerocopy_orphan{
+        int fd;
+        zerocopy_sender* sender;
+        int64_t deadline_ns;
+    };
+    std::vector<zerocopy_orphan> zerocopy_orphans;
+    //有待完成的发送时周期性唤醒本线程，读取完成通知
+    timer_id zerocopy_timer;
+
+    //运行计数，只由本线程写入
+    std::atomic<long> dispatches;
+    std::atomic<long> wakeups;
+    std::atomic<long> dispatched_events;
+    std::atomic<long> busy_poll_hits;
+    std::atomic<long> busy_poll_misses;
+    std::atomic<long> busy_poll_ns;
+    std::atomic<long> worker_completions;
+    std::atomic<long> tasks_run;
+    std::atomic<long> task_batches;
+    std::atomic<long> last_task_batch;
+    std::atomic<long> max_task_batch;
+    std::atomic<long> socket_reads;
+    std::atomic<long> socket_writes;
+    std::atomic<long> socket_accepts;
+    std::atomic<long> deferred_flushes;
+
+    //其他线程投递的任务，每轮整体交换到running_tasks中执行，两个vector的容量都会复用
+    pthread_mutex_t task_mutex;
+    std::vector<loop_task> queued_tasks;
+    std::vector<loop_task> running_tasks;
+    //queued_tasks中的任务数，poll_events据此决定是否阻塞
+    std::atomic<size_t> queued_task_count;
+
+    worker_pool* p_worker_pool;
+    //worker_job的无锁多生产者单消费者队列，与pending_channel_queue相同
+    std::atomic<worker_job*> completions;
+
+    std::atomic<long> connections;
+    std::atomic<long> pending_bytes;
+
+    int cpu;
+    int numa_node;
 
     pthread_t owner_thread_id;
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
 };
 
 class event_loop_thread{
@@ -233,9 +590,12 @@ public:
     
     ~event_loop_thread();
     
-    event_loop* start(int no);
+    event_loop* start(int no, const event_loop_options& options = event_loop_options());
     
     void* run();
+
+    //让event_loop退出并join线程，析构时也会调用
+    void stop();
     
     event_loop* get_event_loop();
 
@@ -246,6 +606,16 @@ private:
     pthread_cond_t cond;
     int thread;
     const char* thread_name;
+    event_loop_options loop_options;
+    int cpu;//绑定的CPU，-1为不绑定
+    bool is_stopped;
+};
+
+enum placement_policy{
+    placement_round_robin,
+    placement_least_connections,//连接数最少
+    placement_least_pending_bytes,//待处理字节数最少
+    placement_power_of_two,//随机取两个，选连接数少的
 };
 
 class thread_pool{
@@ -253,23 +623,45 @@ class thread_pool{
     线程池，从reactor线程。
 */
 public:
-    thread_pool(event_loop* a_main_loop, int a_thread_number);
+    thread_pool(event_loop* a_main_loop, int a_thread_number, const event_loop_options& options = event_loop_options());
 
     ~thread_pool();
 
     void start();
 
+    //所有从reactor线程退出并join
+    void stop();
+
+    //按placement_policy为新连接选择event_loop，只能在主线程中调用
     event_loop* get_event_loop();
 
+    event_loop* get_event_loop(int index);
+
+    void set_placement_policy(placement_policy a_policy);
+
+    int get_thread_number();
+
 private:
     bool is_started;
     event_loop* p_main_loop;//创建该thread_pool的主线程。
     int thread_number;//线程数
     event_loop_thread* event_loop_threads;//数组指针，指向创建的event_loop_thread数组
     int position;//表示在数组里的位置，用来决定选择哪个event_loop_thread服务
+    event_loop_options loop_options;
+    placement_policy policy;
+    uint64_t random_state;
+
+    //从position开始找负载最小的，负载相同时依次轮换
+    event_loop* least_loaded(bool by_bytes);
+
+    event_loop* power_of_two();
 };
 
 class buffer{
+/*
+    数据块在第一次写入时才从本线程的buffer_pool中取得，按需换成更大的级别，
+    空闲的连接只保留buffer对象本身。
+*/
 public:
     buffer();
     
@@ -298,9 +690,18 @@ public:
     int send(tcp_connection* t);
 
     void clear();
+
+    //丢弃前size字节，已全部读完时读写位置归零
+    void consume(int size);
+
+    //数据已全部读完时把数据块还给buffer_pool
+    void release();
     
     auto capacity();
 
+    //把数据区迁移到node上，由跨线程创建的连接使用
+    void bind_numa_node(int node);
+
 private:
     void make_room(int size);
 
@@ -316,23 +717,143 @@ public:
 
     tcp_connection(const tcp_connection& r) = delete;
 
-    ~tcp_connection();
-    //buffer读取到数据时调用
+    virtual ~tcp_connection();
+    //input_buffer读取到数据时调用，处理过的字节需要consume，剩下的留到下次读到数据时
     virtual int message(buffer* buf);
-    //buffer写完数据后调用
+    //output_buffer中积压的数据全部发出后调用
     virtual int write_completed();
+    //调用过wait_output_drained之后，output_buffer降到低水位以下时调用一次
+    virtual int output_drained();
     //连接关闭后调用
     virtual int connection_closed();
+    //channel注册到event_loop后，在event_loop线程内调用
+    virtual int connection_opened();
 
+    //连接已经关闭时返回-1
     int send_data(const void* data, int size);
+
+    //发送chain中的全部数据，发不完的段不复制地移入output_buffer，chain变为空。连接已经关闭时返回-1
+    long send_chain(chain_buffer* chain);
     
-    void shutdown_connection();
+    //关闭写方向，output_buffer中还有数据时等全部发出后再关闭。连接已经关闭时返回-1
+    int shutdown_connection();
+
+    //low不超过high，需要在连接注册到event_loop之前设置
+    void set_output_watermarks(long high, long low);
+
+    //output_buffer达到高水位，生产者应暂停，等output_drained再继续
+    bool is_output_full();
+
+    //output_buffer降到低水位以下时调用output_drained
+    void wait_output_drained();
+
+    //暂停读取，新数据留在内核中，直到resume_reading。与输出高水位的暂停互不影响
+    void pause_reading();
+
+    void resume_reading();
+
+    /*
+        一次发送达到threshold字节时以MSG_ZEROCOPY发送，为0时关闭。需要在连接注册到
+        event_loop之前设置，套接字不支持时返回-1。
+    */
+    int set_zerocopy_threshold(long threshold);
+
+    //立即关闭连接，连接对象在本轮事件处理完后释放
+    void force_close();
+
+    /*
+        channel已经关闭。连接对象要到本轮末尾才释放，这期间fd已经close，
+        编号可能已被新连接复用，不能再对它发送。
+    */
+    bool is_closed();
+
+    //派生类构造完成后由TCPserver调用，将channel交给event_loop
+    void connection_established(bool need_wakeup = true);
 protected:
+    //连接上的定时器，连接释放时自动取消
+    timer_id run_after(int64_t delay_ms, std::function<void()> callback);
+
+    timer_id run_every(int64_t interval_ms, std::function<void()> callback);
+
+    void cancel(timer_id id);
+
+    /*
+        把work交给event_loop的工作线程池执行，完成后在本连接的event_loop线程中调用done。
+        同一连接的任务逐个执行，done按提交顺序调用；连接先关闭时done不再调用。
+        没有工作线程池时直接依次调用work和done。
+    */
+    void run_in_worker(std::function<void()> work, std::function<void()> done);
+
+    bool has_worker_jobs();
+
     event_loop* p_event_loop;
     channel* m_channel;
     buffer* input_buffer;
-    buffer* output_buffer;
+    chain_buffer* output_buffer;
     char* name;
+
+private:
+    friend class connection_channel;
+    friend class connection_job;
+
+    void cancel_timers();
+
+    //把缓冲区中的字节数变化计入event_loop的pending_bytes
+    void update_pending_bytes();
+
+    //一次读事件处理完后，空的缓冲区把数据块还给buffer_pool，空闲连接不占用数据块
+    void release_idle_buffers();
+
+    //EPOLLOUT时发送output_buffer，出错时返回-1，读到EOF后发送完毕时返回1，都由channel关闭连接
+    int handle_write();
+
+    //读到EOF时调用，output_buffer中还有数据时停止读、等发送完再关闭，返回1表示立即关闭
+    int handle_eof();
+
+    //数据追加到output_buffer之后调用，开启写事件，超过高水位时暂停读
+    void output_queued();
+
+    //EPOLLERR时取出MSG_ZEROCOPY的完成通知，没有开启或错误队列中有其他错误时返回-1
+    int handle_error();
+
+    //channel关闭fd之前调用，有未完成的MSG_ZEROCOPY发送时把zerocopy交给event_loop
+    void handle_closing();
+
+    //corked_writes下在轮末发送output_buffer，返回值同handle_write
+    int handle_flush();
+
+    //开启corked_writes时把数据留在output_buffer中，排入轮末的flush，返回false表示应立即发送
+    bool defer_write();
+
+    //发送output_buffer，计入event_loop的socket_writes
+    long write_output();
+
+    //发送之后检查是否有人在等output_buffer降到低水位以下
+    void check_output_drained();
+
+    //水位和pause_reading都不再暂停、也没有读到EOF时重新开始读
+    void restart_reading();
+
+    long high_watermark;
+    long low_watermark;
+    bool reading_paused;
+    //由pause_reading暂停
+    bool reading_held;
+    //对端关闭了写方向，不再读，output_buffer发送完后关闭连接
+    bool input_closed;
+    bool shutdown_pending;
+    bool flush_queued;
+    bool drain_wanted;
+    //连接关闭时可能交给event_loop，之后为nullptr
+    zerocopy_sender* zerocopy;
+
+    std::vector<timer_id> timers;
+    long reported_pending_bytes;
+
+    void worker_job_completed(connection_job* job);
+
+    //第一个已提交给线程池，其余的等它完成后再提交
+    std::deque<connection_job*> worker_jobs;
 };
 
 class TCPserver_base{
@@ -345,21 +866,81 @@ public:
     
     virtual void start() = 0;
 
-    virtual int handle_connection_established() = 0;
+    //listen_fd上有新连接时，由其所在的event_loop线程调用。
+    //返回1表示预算用尽，backlog中可能还有连接
+    virtual int handle_connection_established(int listen_fd, event_loop* accept_loop) = 0;
 
 };
 
 template<typename Connection_Type>
 class TCPserver : public TCPserver_base{
 public:
-    TCPserver(int port, int a_thread_num ) :
-        main_event_loop{},
-        m_acceptor(port),
+    TCPserver(int port, int a_thread_num, const event_loop_options& options = event_loop_options()) :
+        main_event_loop("main thread", options),
+        listen_port(port),
+        reuse_port{},
+        accept_budget(ACCEPT_BUDGET),
+        acceptors{},
+        listen_channels{},
         thread_num(a_thread_num),
-        m_thread_pool(&main_event_loop, thread_num)
+        m_thread_pool(&main_event_loop, thread_num, options),
+        worker_threads{},
+        workers{},
+        high_watermark(OUTPUT_HIGH_WATERMARK),
+        low_watermark(OUTPUT_LOW_WATERMARK),
+        zerocopy_threshold{}
     {}
     
-    ~TCPserver(){}
+    ~TCPserver(){
+        //监听套接字在各自的event_loop中关闭，channel在该轮末尾释放
+        for(auto cc : listen_channels)
+            cc->get_event_loop()->run_in_loop([cc]{ cc->get_event_loop()->close_channel(cc); });
+        //从reactor线程退出之后不会再向工作线程提交任务
+        m_thread_pool.stop();
+        //join工作线程，没来得及执行的任务直接释放
+        delete workers;
+        for(auto a_acceptor : acceptors)
+            delete a_acceptor;
+    }
+
+    /*
+        开启后每个从reactor线程各自拥有一个以SO_REUSEPORT绑定的监听套接字，由内核
+        在各线程间分发连接，连接的accept和后续读写都在同一个线程内完成，不再经过主线程
+        转交。需要在start()之前设置。
+    */
+    void set_reuse_port(bool enable){
+        reuse_port = enable;
+    }
+
+    //每次监听套接字就绪时最多accept的连接数，用尽后留到下一轮，避免饿死其他channel
+    void set_accept_budget(int budget){
+        accept_budget = budget > 0 ? budget : 1;
+    }
+
+    //主线程把连接交给从reactor线程时的分配策略，SO_REUSEPORT模式下不起作用
+    void set_placement_policy(placement_policy policy){
+        m_thread_pool.set_placement_policy(policy);
+    }
+
+    //每个连接output_buffer的高低水位
+    void set_output_watermarks(long high, long low){
+        high_watermark = high;
+        low_watermark = std::min(low, high);
+    }
+
+    /*
+        每个连接上一次发送达到threshold字节时以MSG_ZEROCOPY发送，为0时关闭。
+        省去把数据复制进内核的开销，但每次发送要锁定页面、并多一次完成通知，
+        只适合较大的响应体。
+    */
+    void set_zerocopy_threshold(long threshold){
+        zerocopy_threshold = threshold;
+    }
+
+    //业务逻辑线程数，为0时message在I/O线程内处理。需要在start()之前设置
+    void set_worker_threads(int number){
+        worker_threads = number;
+    }
     
     void start() override{
         /*
@@ -368,48 +949,118 @@ public:
         //开启多个线程
         m_thread_pool.start();
 
-        int listen_fd = m_acceptor.get_listen_fd();
-
-        channel* cc = new listen_channel(listen_fd, EVENT_READ, &main_event_loop, this);
-
-        main_event_loop.add_channel_event(listen_fd, cc);
+        if(worker_threads > 0){
+            workers = new worker_pool(worker_threads);
+            workers->start();
+            main_event_loop.set_worker_pool(workers);
+            for(int i{}; i < thread_num; ++i)
+                m_thread_pool.get_event_loop(i)->set_worker_pool(workers);
+        }
+
+        if(reuse_port && thread_num > 0){
+            for(int i{}; i != thread_num; ++i)
+                listen_on(new acceptor(listen_port, true), m_thread_pool.get_event_loop(i));
+        }
+        else
+            listen_on(new acceptor(listen_port), &main_event_loop);
 
         return;
     }
 
-    int handle_connection_established() override{
+    int handle_connection_established(int listen_fd, event_loop* accept_loop) override{
         /*
-            当出现了新的连接，主线程需要调用该函数。
+            当出现了新的连接，监听套接字所在的线程需要调用该函数。
+            监听套接字为边沿触发，一次就绪要把backlog中的连接尽量取完，直到EAGAIN或
+            预算用尽。同一批中交给同一个event_loop的连接只唤醒它一次。
         */
-        int listen_fd = m_acceptor.get_listen_fd();
-
-        sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-
-        int connect_fd = accept(listen_fd, pointer_cast<sockaddr*>(&client_addr), &client_len);
-        if(connect_fd == -1)
-            throw std::runtime_error("connect failed");
-        make_noblocking(connect_fd);
-
-        //msg "new connection established, socket:", connect_fd
-
-        //从线程池中选择一个event_loop来服务这个新的连接套接字，
-        //并为其创建一个tcp_connection对象
-        tcp_connection* connection = new Connection_Type(connect_fd, m_thread_pool.get_event_loop());
-        
-
-        return 0;
+        static thread_local std::vector<event_loop*> woken;
+        woken.clear();
+
+        int accepted{};
+        int more{};
+        while(1){
+            if(accepted == accept_budget){
+                more = 1;
+                break;
+            }
+
+            int connect_fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            accept_loop->add_socket_accepts(1);
+            if(connect_fd == -1){
+                if(errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                if(errno != EAGAIN && errno != EWOULDBLOCK)
+                    //EMFILE等，保留backlog中的连接，等下一次就绪再取
+                    log_err("[TCPserver] accept failed: %s\n", strerror(errno));
+                break;
+            }
+            ++accepted;
+
+            //msg "new connection established, socket:", connect_fd
+
+            //从线程池中选择一个event_loop来服务这个新的连接套接字，
+            //并为其创建一个tcp_connection对象。SO_REUSEPORT模式下就由接受连接的线程服务
+            event_loop* selected = reuse_port ? accept_loop : m_thread_pool.get_event_loop();
+            int busy_poll = selected->get_options().socket_busy_poll_us;
+            if(busy_poll > 0 && setsockopt(connect_fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)))
+                //超过net.core.busy_read时需要CAP_NET_ADMIN
+                log_msg("[TCPserver] set SO_BUSY_POLL failed: %s\n", strerror(errno));
+            tcp_connection* connection = new Connection_Type(connect_fd, selected);
+            connection->set_output_watermarks(high_watermark, low_watermark);
+            if(zerocopy_threshold > 0 && connection->set_zerocopy_threshold(zerocopy_threshold))
+                log_msg("[TCPserver] enable SO_ZEROCOPY failed: %s\n", strerror(errno));
+            connection->connection_established(false);
+
+            //accept_loop就是当前线程，已经直接处理过了
+            if(selected != accept_loop && std::find(woken.begin(), woken.end(), selected) == woken.end())
+                woken.push_back(selected);
+        }
+
+        for(auto a_event_loop : woken)
+            a_event_loop->wakeup();
+
+        return more;
     }
 
     int run(){
         return main_event_loop.run();
     }
+
+    //用于查看各个从reactor线程的负载和计数
+    thread_pool* get_thread_pool(){
+        return &m_thread_pool;
+    }
+
+    //用于查看主线程的计数，没有SO_REUSEPORT时accept都在主线程中
+    event_loop* get_main_loop(){
+        return &main_event_loop;
+    }
 private:
+    void listen_on(acceptor* a_acceptor, event_loop* a_event_loop){
+        acceptors.push_back(a_acceptor);
+
+        int listen_fd = a_acceptor->get_listen_fd();
+        channel* cc = new listen_channel(listen_fd, EVENT_READ, a_event_loop, this);
+        listen_channels.push_back(cc);
+        a_event_loop->add_channel_event(listen_fd, cc);
+    }
+
     event_loop main_event_loop;
-    acceptor m_acceptor;
+    int listen_port;
+    bool reuse_port;
+    int accept_budget;
+    std::vector<acceptor*> acceptors;
+    std::vector<channel*> listen_channels;
 
     int thread_num;
     thread_pool m_thread_pool;//从reactor线程线程池
+
+    int worker_threads;
+    worker_pool* workers;
+
+    long high_watermark;
+    long low_watermark;
+    long zerocopy_threshold;
 };
 
 #endif
@@ -0,0 +1,240 @@
+#include"timer_wheel.h"
+
+timer_wheel::timer_wheel() :
+    nodes{},
+    free_head(-1),
+    slots{},
+    start_ms(now_ms()),
+    current_tick{},
+    active_count{}
+{
+    for(auto& level : slots)
+        for(auto& head : level)
+            head = -1;
+}
+
+timer_id timer_wheel::add(int64_t delay_ms, int64_t interval_ms, std::function<void()> callback){
+    int64_t now = now_tick();
+    //时间轮为空时timerfd已停止，直接追上当前时间
+    if(!active_count)
+        current_tick = now;
+
+    int index;
+    if(free_head != -1){
+        index = free_head;
+        free_head = nodes[index].next;
+    }
+    else{
+        index = nodes.size();
+        nodes.push_back(timer_node{});
+        nodes[index].generation = 1;
+    }
+
+    //不足一个tick的按一个tick算，保证不早于delay_ms触发
+    int64_t delay_ticks = (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    int64_t interval_ticks = (interval_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+    timer_node& node = nodes[index];
+    node.state = node_pending;
+    node.deadline_tick = (now > current_tick ? now : current_tick) + (delay_ticks > 0 ? delay_ticks : 1);
+    node.expire_tick = node.deadline_tick;
+    node.interval_ticks = interval_ms > 0 && interval_ticks == 0 ? 1 : interval_ticks;
+    node.callback = std::move(callback);
+    insert(index);
+
+    ++active_count;
+    return (static_cast<timer_id>(node.generation) << 32) | static_cast<uint32_t>(index + 1);
+}
+
+bool timer_wheel::cancel(timer_id id){
+    int index = find(id);
+    if(index == -1)
+        return false;
+
+    timer_node& node = nodes[index];
+    if(node.state == node_firing){
+        //回调中取消自身，回调返回后再释放
+        node.state = node_cancelled;
+        return true;
+    }
+    unlink(index);
+    release(index);
+    return true;
+}
+
+bool timer_wheel::is_active(timer_id id){
+    int index = find(id);
+    return index != -1 && nodes[index].state != node_cancelled;
+}
+
+int timer_wheel::expire(){
+    int64_t now = now_tick();
+    int fired{};
+
+    while(current_tick < now){
+        ++current_tick;
+
+        int slot = current_tick & SLOT_MASK;
+        if(!slot){
+            for(int level = 1; level != LEVELS; ++level)
+                if(cascade(level))
+                    break;
+        }
+
+        while(slots[0][slot] != -1){
+            int index = slots[0][slot];
+            unlink(index);
+
+            //超出范围被提前放置的，还没到期时重新插入
+            if(nodes[index].deadline_tick > current_tick){
+                nodes[index].expire_tick = nodes[index].deadline_tick;
+                insert(index);
+                continue;
+            }
+
+            //回调中可能新增定时器导致nodes扩容，回调期间不能持有节点的引用
+            nodes[index].state = node_firing;
+            std::function<void()> callback = std::move(nodes[index].callback);
+            callback();
+            ++fired;
+
+            timer_node& node = nodes[index];
+            if(node.state == node_firing && node.interval_ticks > 0){
+                node.state = node_pending;
+                node.deadline_tick = current_tick + node.interval_ticks;
+                node.expire_tick = node.deadline_tick;
+                node.callback = std::move(callback);
+                insert(index);
+            }
+            else
+                release(index);
+        }
+    }
+    return fired;
+}
+
+int64_t timer_wheel::next_expire_ms(){
+    if(!active_count)
+        return -1;
+
+    //每层从当前位置的下一个槽开始按时间顺序找第一个非空槽，当前位置的槽放的是下一圈的
+    int64_t earliest = -1;
+    for(int level{}; level != LEVELS; ++level){
+        int position = (current_tick >> (SLOT_BITS * level)) & SLOT_MASK;
+        for(int i = 1; i <= SLOTS; ++i){
+            int index = slots[level][(position + i) & SLOT_MASK];
+            if(index == -1)
+                continue;
+            int64_t tick = earliest_tick(index);
+            if(earliest == -1 || tick < earliest)
+                earliest = tick;
+            break;
+        }
+    }
+    //回调中的定时器不在槽中，全部在回调中时由expire之后的调用处理
+    if(earliest == -1)
+        return -1;
+    return start_ms + earliest * TIMER_TICK_MS;
+}
+
+int64_t timer_wheel::expire_ms(timer_id id){
+    int index = find(id);
+    if(index == -1)
+        return -1;
+    return start_ms + nodes[index].expire_tick * TIMER_TICK_MS;
+}
+
+int timer_wheel::size(){
+    return active_count;
+}
+
+int64_t timer_wheel::now_ms(){
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+//private
+int64_t timer_wheel::now_tick(){
+    return (now_ms() - start_ms) / TIMER_TICK_MS;
+}
+
+int timer_wheel::find(timer_id id){
+    int index = static_cast<int>(id & 0xffffffff) - 1;
+    if(index < 0 || index >= static_cast<int>(nodes.size()))
+        return -1;
+    
+    const timer_node& node = nodes[index];
+    if(node.generation != (id >> 32) || node.state == node_free)
+        return -1;
+    return index;
+}
+
+void timer_wheel::insert(int index){
+    timer_node& node = nodes[index];
+
+    //cascade下来正好在本tick到期的放在第0层当前的槽，expire随后就会回调
+    int64_t delta = node.expire_tick - current_tick;
+    if(delta < 0){
+        node.expire_tick = current_tick;
+        delta = 0;
+    }
+
+    int level{};
+    while(level != LEVELS - 1 && delta >= (int64_t(1) << (SLOT_BITS * (level + 1))))
+        ++level;
+    //超出时间轮范围的放在最外层最远的槽，deadline_tick不变，轮到时由expire重新插入
+    int64_t max_delta = (int64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+    if(delta > max_delta)
+        node.expire_tick = current_tick + max_delta;
+
+    node.level = level;
+    node.slot = (node.expire_tick >> (SLOT_BITS * level)) & SLOT_MASK;
+    node.prev = -1;
+    node.next = slots[level][node.slot];
+    if(node.next != -1)
+        nodes[node.next].prev = index;
+    slots[level][node.slot] = index;
+}
+
+void timer_wheel::unlink(int index){
+    timer_node& node = nodes[index];
+    if(node.prev != -1)
+        nodes[node.prev].next = node.next;
+    else
+        slots[node.level][node.slot] = node.next;
+    if(node.next != -1)
+        nodes[node.next].prev = node.prev;
+    node.prev = node.next = -1;
+}
+
+int64_t timer_wheel::earliest_tick(int index){
+    int64_t tick = nodes[index].expire_tick;
+    for(index = nodes[index].next; index != -1; index = nodes[index].next)
+        if(nodes[index].expire_tick < tick)
+            tick = nodes[index].expire_tick;
+    return tick;
+}
+
+int timer_wheel::cascade(int level){
+    int slot = (current_tick >> (SLOT_BITS * level)) & SLOT_MASK;
+    int index = slots[level][slot];
+    slots[level][slot] = -1;
+
+    while(index != -1){
+        int next = nodes[index].next;
+        insert(index);
+        index = next;
+    }
+    return slot;
+}
+
+void timer_wheel::release(int index){
+    timer_node& node = nodes[index];
+    node.state = node_free;
+    node.callback = nullptr;
+    ++node.generation;
+    node.next = free_head;
+    free_head = index;
+    --active_count;
+}
@@ -0,0 +1,95 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include"common.h"
+
+typedef uint64_t timer_id;//0表示无效
+
+const int64_t TIMER_TICK_MS = 10;
+
+class timer_wheel{
+/*
+    分层时间轮：共4层，每层64个槽。第0层每个槽为一个tick，上层每个槽覆盖下一层的
+    一整圈，上层的槽轮到时把其中的定时器重新分配到下层（cascade）。
+
+    定时器节点存放在数组中，槽内以下标串成双向链表，空闲节点串成单链表复用。
+    超出时间轮范围（约46.6小时）的定时器先放在最外层最远的槽，轮到时还没有到期的重新插入。
+
+    timer_id由节点下标和代数组成，节点释放后代数加一，过期的timer_id不会误取消
+    复用该节点的新定时器。插入、取消均为O(1)。
+
+    只能在所属event_loop的线程内使用。
+*/
+public:
+    timer_wheel();
+
+    timer_id add(int64_t delay_ms, int64_t interval_ms, std::function<void()> callback);
+
+    bool cancel(timer_id id);
+
+    bool is_active(timer_id id);
+
+    //推进到当前时间并回调所有到期的定时器，返回回调的个数
+    int expire();
+
+    //最近一次需要expire的时间（CLOCK_MONOTONIC毫秒），没有定时器时返回-1
+    int64_t next_expire_ms();
+
+    //id对应定时器的到期时间，id无效时返回-1
+    int64_t expire_ms(timer_id id);
+
+    int size();
+
+    static int64_t now_ms();
+
+private:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const int SLOT_MASK = SLOTS - 1;
+
+    enum node_state{
+        node_free,
+        node_pending,
+        node_firing,
+        node_cancelled
+    };
+
+    struct timer_node{
+        int prev;
+        int next;
+        int level;
+        int slot;
+        uint32_t generation;
+        node_state state;
+        //所在槽对应的tick，超出时间轮范围时早于deadline_tick
+        int64_t expire_tick;
+        int64_t deadline_tick;
+        int64_t interval_ticks;
+        std::function<void()> callback;
+    };
+
+    int64_t now_tick();
+
+    int find(timer_id id);
+
+    void insert(int index);
+
+    void unlink(int index);
+
+    //index所在的链表中最早的expire_tick
+    int64_t earliest_tick(int index);
+
+    int cascade(int level);
+
+    void release(int index);
+
+    std::vector<timer_node> nodes;
+    int free_head;
+    int slots[LEVELS][SLOTS];
+    int64_t start_ms;
+    int64_t current_tick;
+    int active_count;
+};
+
+#endif
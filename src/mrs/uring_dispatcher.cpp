@@ -0,0 +1,251 @@
+#include"uring_dispatcher.h"
+
+//撤销poll的SQE使用的user_data，它的CQE直接忽略
+static const uint64_t REMOVE_TAG = ~uint64_t{};
+
+static int io_uring_setup(unsigned entries, io_uring_params* p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                            unsigned flags, void* arg, size_t arg_size) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static uint64_t make_user_data(int fd, uint32_t generation) {
+    return (uint64_t(generation) << 32) | uint32_t(fd);
+}
+
+uring_dispatcher::uring_dispatcher(channel_map* a_channel_map, const event_loop_options& options) :
+    event_dispatcher(a_channel_map, options),
+    ring_fd(-1),
+    sq_ring(MAP_FAILED),
+    sq_ring_size{},
+    sqes(static_cast<io_uring_sqe*>(MAP_FAILED)),
+    sqes_size{},
+    sq_head{},
+    sq_tail{},
+    sq_mask{},
+    sq_entries{},
+    sq_array{},
+    sq_local_tail{},
+    cq_head{},
+    cq_tail{},
+    cq_mask{},
+    cqes{},
+    generations(1024),
+    armed(1024),
+    m_events{}
+{
+    io_uring_params params{};
+    ring_fd = io_uring_setup(URING_ENTRIES, &params);
+    if(ring_fd == -1)
+        throw std::runtime_error("io_uring setup failed");
+
+    /*
+        multishot poll需要5.13以上的内核，它和IORING_FEAT_RSRC_TAGS同时加入，
+        用这个特性位来判断。EXT_ARG用于带超时的等待，NODROP保证CQ满时不丢事件。
+    */
+    const unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                            IORING_FEAT_EXT_ARG | IORING_FEAT_RSRC_TAGS;
+    if((params.features & need) != need) {
+        close(ring_fd);
+        throw std::runtime_error("io_uring lacks multishot poll");
+    }
+
+    //SQ和CQ共用一次映射
+    sq_ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+    if(sq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+        if(sq_ring != MAP_FAILED)
+            munmap(sq_ring, sq_ring_size);
+        close(ring_fd);
+        throw std::runtime_error("io_uring mmap failed");
+    }
+
+    char* base = static_cast<char*>(sq_ring);
+    sq_head = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+    sq_entries = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_entries);
+    sq_array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+    sq_local_tail = *sq_tail;
+
+    cq_head = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+
+    m_events = new io_uring_cqe[event_count];
+    log_msg("[uring dispatcher] ring fd = %d, %u entries\n", ring_fd, sq_entries);
+}
+
+uring_dispatcher::~uring_dispatcher() {
+    delete[] m_events;
+    munmap(sqes, sqes_size);
+    munmap(sq_ring, sq_ring_size);
+    close(ring_fd);
+}
+
+int uring_dispatcher::add(channel* cc) {
+    arm(cc->get_fd(), cc->get_events());
+    return 0;
+}
+
+int uring_dispatcher::remove(channel* cc) {
+    disarm(cc->get_fd());
+    return 0;
+}
+
+int uring_dispatcher::update(channel* cc) {
+    disarm(cc->get_fd());
+    arm(cc->get_fd(), cc->get_events());
+    return 0;
+}
+
+void uring_dispatcher::close_channel(channel* cc) {
+    int fd = cc->get_fd();
+    if(!cc->is_closed() && unsigned(fd) < armed.size() && armed[fd]) {
+        disarm(fd);
+        //poll持有文件的引用，撤销提交之前close不会真正关闭套接字
+        submit(0, 0, nullptr, 0);
+    }
+    event_dispatcher::close_channel(cc);
+}
+
+int uring_dispatcher::dispatch(int timeout_ms) {
+    unsigned head = *cq_head;
+    bool ready = head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+    //CQ中已有事件时不等待；没有要提交的SQE又不等待时连系统调用都省掉
+    if(ready || timeout_ms == 0) {
+        if(sq_local_tail != __atomic_load_n(sq_head, __ATOMIC_ACQUIRE))
+            submit(0, 0, nullptr, 0);
+    }
+    else if(timeout_ms < 0) {
+        submit(IORING_ENTER_GETEVENTS, 1, nullptr, 0);
+    }
+    else {
+        __kernel_timespec ts{timeout_ms / 1000, (timeout_ms % 1000) * 1000000LL};
+        io_uring_getevents_arg arg{};
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+        submit(IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, 1, &arg, sizeof(arg));
+    }
+
+    //先拷贝出来再回调，回调中注册、注销会写SQ，可能触发提交
+    int n{};
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while(head != tail && n < event_count)
+        m_events[n++] = cqes[head++ & cq_mask];
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+    for(int i{}; i < n; ++i) {
+        const io_uring_cqe& cqe = m_events[i];
+        if(cqe.user_data == REMOVE_TAG)
+            continue;
+
+        int fd = int(cqe.user_data & 0xffffffff);
+        uint32_t generation = uint32_t(cqe.user_data >> 32);
+        //fd已注销或被复用，这是旧poll的事件
+        if(unsigned(fd) >= armed.size() || !armed[fd] || generations[fd] != generation)
+            continue;
+
+        channel* cc = (*p_channel_map)[fd];
+        if(!cc)
+            continue;
+
+        if(cqe.res > 0)
+            handle_event(cc, cqe.res);
+        else if(cqe.res < 0 && cqe.res != -ECANCELED)
+            handle_event(cc, EPOLLERR | EPOLLHUP);
+
+        //没有F_MORE说明multishot已经终止（如内核中途取消），仍在监听时重新提交
+        if(!(cqe.flags & IORING_CQE_F_MORE) && !cc->is_closed() &&
+            armed[fd] && generations[fd] == generation) {
+            disarm(fd);
+            arm(fd, cc->get_events());
+        }
+    }
+
+    if(grow_events(n)) {
+        delete[] m_events;
+        m_events = new io_uring_cqe[event_count];
+    }
+    return n;
+}
+
+const char* uring_dispatcher::get_name() {
+    return "io_uring poll";
+}
+
+//private
+io_uring_sqe* uring_dispatcher::get_sqe() {
+    //SQ已满，先把已有的SQE交给内核
+    if(sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+        submit(0, 0, nullptr, 0);
+
+    unsigned index = sq_local_tail & sq_mask;
+    io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    ++sq_local_tail;
+    return sqe;
+}
+
+int uring_dispatcher::submit(unsigned flags, unsigned min_complete, void* arg, size_t arg_size) {
+    //内核没取走的SQE留在环中，下次一起提交
+    unsigned to_submit = sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+
+    int ret = io_uring_enter(ring_fd, to_submit, min_complete, flags, arg, arg_size);
+    syscalls.fetch_add(1, std::memory_order_relaxed);
+    //被信号打断或等待超时不算错误
+    if(ret == -1 && errno != ETIME && errno != EINTR)
+        log_err("[uring dispatcher] io_uring_enter failed\n");
+    return ret;
+}
+
+void uring_dispatcher::arm(int fd, int events) {
+    if(unsigned(fd) >= armed.size()) {
+        size_t size = armed.size();
+        while(size <= unsigned(fd))
+            size *= 2;
+        generations.resize(size);
+        armed.resize(size);
+    }
+
+    //poll的掩码和epoll相同，默认即为边缘触发
+    uint32_t poll_events = EPOLLERR | EPOLLHUP;
+    if(events & EVENT_READ)
+        poll_events |= EPOLLIN;
+    if(events & EVENT_WRITE)
+        poll_events |= EPOLLOUT;
+
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = poll_events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = make_user_data(fd, ++generations[fd]);
+    armed[fd] = true;
+}
+
+void uring_dispatcher::disarm(int fd) {
+    if(unsigned(fd) >= armed.size() || !armed[fd])
+        return;
+
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = make_user_data(fd, generations[fd]);
+    sqe->user_data = REMOVE_TAG;
+    //代数加一，撤销生效之前已经产生的CQE会被丢弃
+    ++generations[fd];
+    armed[fd] = false;
+}
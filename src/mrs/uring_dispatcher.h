@@ -0,0 +1,75 @@
+#ifndef URING_DISPATCHER_H
+#define URING_DISPATCHER_H
+
+#include"tcp_server.h"
+#include<linux/io_uring.h>
+#include<sys/mman.h>//mmap()，不放在common.h中，content_type.cpp里有同名的表
+
+const unsigned URING_ENTRIES = 256;
+
+class uring_dispatcher : public event_dispatcher{
+/*
+    基于io_uring的事件分发。每个channel提交一个multishot的POLL_ADD，就绪时产生
+    CQE而不需要重新注册；注册、注销和等待都只是往SQ中写入SQE，在dispatch时随
+    一次io_uring_enter提交并收割完成事件。
+    
+    io_uring只用来代替epoll做就绪通知，省下的是epoll_ctl；连接的readv、sendmsg
+    和accept4仍由channel直接调用，每个请求的系统调用次数不会因此降到一次以下。
+    
+    user_data由fd和代数组成（高32位为代数），fd注销或复用后代数加一，收到的旧
+    CQE会因代数不符而被丢弃。
+
+    直接使用系统调用，不依赖liburing。内核不支持multishot poll时构造函数抛出异常，
+    由event_dispatcher::create退回epoll。
+*/
+public:
+    uring_dispatcher(channel_map* a_channel_map, const event_loop_options& options);
+
+    ~uring_dispatcher();
+
+    int add(channel* cc) override;
+
+    int remove(channel* cc) override;
+
+    int update(channel* cc) override;
+
+    int dispatch(int timeout_ms = -1) override;
+
+    //io_uring的poll持有文件的引用，close前必须撤销，否则连接永远不会释放
+    void close_channel(channel* cc) override;
+
+    const char* get_name() override;
+
+private:
+    io_uring_sqe* get_sqe();
+
+    int submit(unsigned flags, unsigned min_complete, void* arg, size_t arg_size);
+
+    void arm(int fd, int events);
+
+    void disarm(int fd);
+
+    int ring_fd;
+    void* sq_ring;
+    size_t sq_ring_size;
+    io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* sq_array;
+    unsigned sq_local_tail;//已写入SQE但还没有提交给内核的位置
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+
+    std::vector<uint32_t> generations;//每个fd当前的代数
+    std::vector<bool> armed;//fd上是否有未撤销的poll
+    io_uring_cqe* m_events;//从CQ中拷贝出来的完成事件，回调期间CQ可以继续被内核写入
+};
+
+#endif
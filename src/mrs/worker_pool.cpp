@@ -0,0 +1,161 @@
+#include"worker_pool.h"
+#include"tcp_server.h"
+
+//worker_job
+worker_job::worker_job(event_loop* a_event_loop) :
+    p_event_loop(a_event_loop),
+    completion_next{}
+{}
+
+worker_job::~worker_job() {}
+
+event_loop* worker_job::get_event_loop() {
+    return p_event_loop;
+}
+
+//worker_pool
+worker_pool::worker_pool(int a_thread_number) :
+    thread_number(std::max(a_thread_number, 1)),
+    workers(new worker[thread_number]),
+    is_started{},
+    quit{},
+    next_worker{},
+    queued{},
+    sleeping{},
+    steals{},
+    idle_mutex{},
+    idle_cond{}
+{
+    for(int i{}; i != thread_number; ++i)
+        pthread_mutex_init(&workers[i].mutex, nullptr);
+    pthread_mutex_init(&idle_mutex, nullptr);
+    pthread_cond_init(&idle_cond, nullptr);
+}
+
+worker_pool::~worker_pool() {
+    if(is_started) {
+        pthread_mutex_lock(&idle_mutex);
+        quit = true;
+        pthread_cond_broadcast(&idle_cond);
+        pthread_mutex_unlock(&idle_mutex);
+        for(int i{}; i != thread_number; ++i)
+            pthread_join(workers[i].thread_id, nullptr);
+    }
+    //没来得及执行的任务直接释放，不再送回event_loop
+    for(int i{}; i != thread_number; ++i) {
+        for(auto job : workers[i].jobs)
+            delete job;
+        pthread_mutex_destroy(&workers[i].mutex);
+    }
+    delete[] workers;
+    pthread_mutex_destroy(&idle_mutex);
+    pthread_cond_destroy(&idle_cond);
+}
+
+void worker_pool::start() {
+    assert(!is_started);
+    is_started = true;
+
+    struct start_arg{
+        worker_pool* pool;
+        int index;
+    };
+    for(int i{}; i != thread_number; ++i) {
+        auto arg = new start_arg{this, i};
+        if(pthread_create(&workers[i].thread_id, nullptr,
+                        [](void* p)->void* {
+                            auto arg = static_cast<start_arg*>(p);
+                            worker_pool* pool = arg->pool;
+                            int index = arg->index;
+                            delete arg;
+                            return pool->run(index);
+                        },
+                        arg))
+            throw std::runtime_error("worker thread create failed");
+    }
+    log_msg("[worker pool] started %d threads\n", thread_number);
+}
+
+void worker_pool::submit(worker_job* job) {
+    /*
+        先计数再入队，queued不会小于0。计数与工作线程睡眠前的检查构成全序：要么
+        这里看到有线程在睡眠而去唤醒，要么工作线程在睡眠前看到queued不为0。
+    */
+    queued.fetch_add(1, std::memory_order_seq_cst);
+
+    worker& w = workers[next_worker.fetch_add(1, std::memory_order_relaxed) % thread_number];
+    pthread_mutex_lock(&w.mutex);
+    w.jobs.push_back(job);
+    pthread_mutex_unlock(&w.mutex);
+
+    if(sleeping.load(std::memory_order_seq_cst) > 0) {
+        pthread_mutex_lock(&idle_mutex);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_mutex);
+    }
+}
+
+int worker_pool::get_thread_number() {
+    return thread_number;
+}
+
+long worker_pool::get_steals() {
+    return steals.load(std::memory_order_relaxed);
+}
+
+//private
+void* worker_pool::run(int index) {
+    while(1) {
+        worker_job* job = take(index);
+        if(job) {
+            job->run();
+            job->get_event_loop()->post_completion(job);
+            continue;
+        }
+
+        pthread_mutex_lock(&idle_mutex);
+        sleeping.fetch_add(1, std::memory_order_seq_cst);
+        while(!quit && queued.load(std::memory_order_seq_cst) == 0)
+            pthread_cond_wait(&idle_cond, &idle_mutex);
+        sleeping.fetch_sub(1, std::memory_order_seq_cst);
+        bool stop = quit;
+        pthread_mutex_unlock(&idle_mutex);
+        if(stop)
+            return nullptr;
+    }
+}
+
+worker_job* worker_pool::take(int index) {
+    //先取自己队列的队头，保持提交顺序
+    worker& own = workers[index];
+    pthread_mutex_lock(&own.mutex);
+    if(!own.jobs.empty()) {
+        worker_job* job = own.jobs.front();
+        own.jobs.pop_front();
+        pthread_mutex_unlock(&own.mutex);
+        queued.fetch_sub(1, std::memory_order_relaxed);
+        return job;
+    }
+    pthread_mutex_unlock(&own.mutex);
+
+    //自己的队列空了，从其他队列的队尾窃取，和队列的主人错开
+    for(int round{}; round != WORKER_STEAL_ROUNDS; ++round) {
+        if(queued.load(std::memory_order_relaxed) == 0)
+            return nullptr;
+        for(int i = 1; i != thread_number; ++i) {
+            worker& victim = workers[(index + i) % thread_number];
+            if(pthread_mutex_trylock(&victim.mutex))
+                continue;
+            if(!victim.jobs.empty()) {
+                worker_job* job = victim.jobs.back();
+                victim.jobs.pop_back();
+                pthread_mutex_unlock(&victim.mutex);
+                queued.fetch_sub(1, std::memory_order_relaxed);
+                steals.fetch_add(1, std::memory_order_relaxed);
+                return job;
+            }
+            pthread_mutex_unlock(&victim.mutex);
+        }
+    }
+    return nullptr;
+}
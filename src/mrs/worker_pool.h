@@ -0,0 +1,82 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include"common.h"
+#include<deque>
+
+class event_loop;
+
+class worker_job{
+/*
+    交给worker_pool执行的任务。run在工作线程中执行，完成后任务被送回所属的
+    event_loop，在其线程中调用complete，之后由event_loop释放。
+*/
+public:
+    worker_job(event_loop* a_event_loop);
+
+    virtual ~worker_job();
+
+    virtual void run() = 0;
+
+    virtual void complete() = 0;
+
+    event_loop* get_event_loop();
+
+private:
+    friend class event_loop;
+
+    event_loop* p_event_loop;
+    //event_loop完成队列的侵入式节点
+    worker_job* completion_next;
+};
+
+const int WORKER_STEAL_ROUNDS = 2;
+
+class worker_pool{
+/*
+    业务逻辑线程池，把耗时的message处理从I/O线程中分离出来。
+
+    每个工作线程有自己的任务队列，提交时轮流放入各个队列；工作线程先取自己队列的
+    队头，为空时从其他线程的队尾窃取，都没有任务时才睡眠。完成的任务经无锁队列
+    送回各自的event_loop，一批完成只唤醒目标线程一次。
+*/
+public:
+    worker_pool(int a_thread_number);
+
+    ~worker_pool();
+
+    void start();
+
+    //可以在任意线程中调用
+    void submit(worker_job* job);
+
+    int get_thread_number();
+
+    //从其他线程队列中窃取到的任务数
+    long get_steals();
+
+private:
+    struct worker{
+        pthread_t thread_id;
+        pthread_mutex_t mutex;
+        std::deque<worker_job*> jobs;
+    };
+
+    void* run(int index);
+
+    worker_job* take(int index);
+
+    int thread_number;
+    worker* workers;
+    bool is_started;
+    bool quit;
+
+    std::atomic<unsigned> next_worker;
+    std::atomic<long> queued;//所有队列中还没被取走的任务数
+    std::atomic<int> sleeping;
+    std::atomic<long> steals;
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_cond;
+};
+
+#endif